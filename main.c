@@ -1,28 +1,62 @@
 #define _GNU_SOURCE
 #include "wlr-screencopy-unstable-v1-client-protocol.h"
+#include <endian.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
 #include <png.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <time.h>
 #include <unistd.h>
 #include <wayland-client.h>
+#include <zlib.h>
+
+struct pixel_format;
+
+// A frame only moves forward: NEGOTIATING collects buffer events until buffer_done allocates the
+// buffer and requests the copy, then ready or failed ends it. Event handlers only record state;
+// the frame_data and everything it points to are released by frame_data_destroy().
+enum frame_state {
+    FRAME_NEGOTIATING,
+    FRAME_COPYING,
+    FRAME_READY,
+    FRAME_FAILED,
+};
 
 struct frame_data {
-    struct wl_buffer* buffer;
-    void* shm_data;
+    enum frame_state state;
+    struct zwlr_screencopy_frame_v1* frame;
+    const struct pixel_format* pfmt;
+    struct wl_buffer* buffer; // owned, NULL until buffer_done
+    void* shm_data; // owned mapping of size bytes, NULL until buffer_done
+    int64_t presented_ns; // compositor presentation clock, arbitrary offset
+    int64_t received_ns; // CLOCK_MONOTONIC when ready arrived
     int width, height, stride;
     uint32_t format;
     size_t size;
 };
 
+#define MAX_OUTPUTS 16
+
+struct output_info {
+    struct wl_output* wl_output;
+    int32_t x, y; // position in the compositor's global space
+    int32_t width, height; // current mode, in buffer pixels
+    int32_t scale;
+    int32_t transform;
+    int32_t refresh; // current mode, mHz
+};
+
 static void* compositor = NULL;
 static void* output = NULL;
+static struct output_info outputs[MAX_OUTPUTS];
+static int output_count = 0;
 static void* wl_shm = NULL;
 static struct zwlr_screencopy_manager_v1* screencopy_manager;
-static struct zwlr_screencopy_frame_v1* frame;
 
 int create_shm_file(size_t size) {
     int fd = memfd_create("screencap-shm", MFD_CLOEXEC);
@@ -35,60 +69,522 @@ int create_shm_file(size_t size) {
     return fd;
 }
 
-void process_pixels(void* data, int width, int height, int stride, uint32_t format) {
-    FILE* f = fopen("capture.png", "wb");
+static inline uint16_t expand10(uint32_t v) {
+    return (uint16_t)((v << 6) | (v >> 4));
+}
+
+static uint16_t half_to_u16[1 << 16];
+
+// Maps every binary16 value to a clamped [0, 1] 16-bit sample. No transfer function is applied, so
+// extended-range (scRGB) content above 1.0 is clipped.
+static void init_half_table(void) {
+    static int initialized = 0;
+    if (initialized)
+        return;
+    for (uint32_t h = 0; h < (1 << 16); h++) {
+        uint32_t sign = h >> 15, exp = (h >> 10) & 0x1f, mant = h & 0x3ff;
+        float f;
+        if (sign || (exp == 0x1f && mant)) {
+            f = 0.0f;
+        } else if (exp == 0x1f) {
+            f = 1.0f;
+        } else if (exp == 0) {
+            f = mant * (1.0f / 16777216.0f);
+        } else {
+            uint32_t bits = ((exp + 112) << 23) | (mant << 13);
+            memcpy(&f, &bits, sizeof(f));
+        }
+        half_to_u16[h] = f >= 1.0f ? 65535 : (uint16_t)(f * 65535.0f + 0.5f);
+    }
+    initialized = 1;
+}
+
+static inline uint32_t load_le32(const uint8_t* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return le32toh(v);
+}
+
+static inline uint16_t load_le16(const uint8_t* p) {
+    uint16_t v;
+    memcpy(&v, p, sizeof(v));
+    return le16toh(v);
+}
+
+static inline uint16_t expand2(uint32_t v) {
+    return (uint16_t)(v * 0x5555);
+}
+
+// wl_shm alpha is premultiplied, PNG alpha is straight. max is the largest sample value.
+static inline uint32_t unpremultiply(uint32_t v, uint32_t a, uint32_t max) {
+    uint32_t straight = a ? (v * max + a / 2) / a : 0;
+    return straight > max ? max : straight;
+}
+
+// Layouts the encoder is fed. The alpha and 16-bit bits combine, so the layout that holds every
+// source of a composite (widest depth, alpha if any source has it) is the OR of their layouts.
+enum pixel_layout {
+    LAYOUT_RGB8 = 0,
+    LAYOUT_RGBA8 = 1,
+    LAYOUT_RGB16 = 2,
+    LAYOUT_RGBA16 = 3,
+    LAYOUT_COUNT,
+};
+
+struct layout_info {
+    int bit_depth; // PNG sample depth
+    int color_type; // PNG_COLOR_TYPE_RGB or PNG_COLOR_TYPE_RGBA
+    int bpp; // bytes per pixel
+};
+
+static const struct layout_info layouts[LAYOUT_COUNT] = {
+    [LAYOUT_RGB8] = { 8, PNG_COLOR_TYPE_RGB, 3 },
+    [LAYOUT_RGBA8] = { 8, PNG_COLOR_TYPE_RGBA, 4 },
+    [LAYOUT_RGB16] = { 16, PNG_COLOR_TYPE_RGB, 6 },
+    [LAYOUT_RGBA16] = { 16, PNG_COLOR_TYPE_RGBA, 8 },
+};
+
+// Per-pixel loads. shm formats are little-endian words; r, g, b and a receive samples at the
+// source depth, 8 bits for the 8888 formats and 16 bits for the deeper ones.
+#define LOAD_XRGB8888(s, r, g, b, a) \
+    do { \
+        r = (s)[2]; \
+        g = (s)[1]; \
+        b = (s)[0]; \
+        a = 0xff; \
+    } while (0)
+
+#define LOAD_ARGB8888(s, r, g, b, a) \
+    do { \
+        r = (s)[2]; \
+        g = (s)[1]; \
+        b = (s)[0]; \
+        a = (s)[3]; \
+    } while (0)
+
+#define LOAD_XBGR8888(s, r, g, b, a) \
+    do { \
+        r = (s)[0]; \
+        g = (s)[1]; \
+        b = (s)[2]; \
+        a = 0xff; \
+    } while (0)
+
+#define LOAD_ABGR8888(s, r, g, b, a) \
+    do { \
+        r = (s)[0]; \
+        g = (s)[1]; \
+        b = (s)[2]; \
+        a = (s)[3]; \
+    } while (0)
+
+#define LOAD_XRGB2101010(s, r, g, b, a) \
+    do { \
+        uint32_t p = load_le32(s); \
+        r = expand10((p >> 20) & 0x3ff); \
+        g = expand10((p >> 10) & 0x3ff); \
+        b = expand10(p & 0x3ff); \
+        a = 0xffff; \
+    } while (0)
+
+#define LOAD_ARGB2101010(s, r, g, b, a) \
+    do { \
+        uint32_t p = load_le32(s); \
+        r = expand10((p >> 20) & 0x3ff); \
+        g = expand10((p >> 10) & 0x3ff); \
+        b = expand10(p & 0x3ff); \
+        a = expand2(p >> 30); \
+    } while (0)
+
+#define LOAD_XBGR2101010(s, r, g, b, a) \
+    do { \
+        uint32_t p = load_le32(s); \
+        r = expand10(p & 0x3ff); \
+        g = expand10((p >> 10) & 0x3ff); \
+        b = expand10((p >> 20) & 0x3ff); \
+        a = 0xffff; \
+    } while (0)
+
+#define LOAD_ABGR2101010(s, r, g, b, a) \
+    do { \
+        uint32_t p = load_le32(s); \
+        r = expand10(p & 0x3ff); \
+        g = expand10((p >> 10) & 0x3ff); \
+        b = expand10((p >> 20) & 0x3ff); \
+        a = expand2(p >> 30); \
+    } while (0)
+
+#define LOAD_XBGR16161616F(s, r, g, b, a) \
+    do { \
+        r = half_to_u16[load_le16((s) + 0)]; \
+        g = half_to_u16[load_le16((s) + 2)]; \
+        b = half_to_u16[load_le16((s) + 4)]; \
+        a = 0xffff; \
+    } while (0)
+
+#define LOAD_ABGR16161616F(s, r, g, b, a) \
+    do { \
+        r = half_to_u16[load_le16((s) + 0)]; \
+        g = half_to_u16[load_le16((s) + 2)]; \
+        b = half_to_u16[load_le16((s) + 4)]; \
+        a = half_to_u16[load_le16((s) + 6)]; \
+    } while (0)
+
+// Loads one pixel, widens 8-bit samples when the layout is 16-bit, un-premultiplies when the source
+// has alpha and stores dst_channels samples; 16-bit samples are written in host order and swapped
+// by libpng if needed. Every condition is a compile-time constant.
+#define CONVERT_PIXEL(LOAD, src_bits, alpha, dst_type, dst_channels, s, d) \
+    do { \
+        uint32_t r, g, b, a; \
+        LOAD(s, r, g, b, a); \
+        if (sizeof(dst_type) * 8 > (src_bits)) { \
+            r *= 257; \
+            g *= 257; \
+            b *= 257; \
+            a *= 257; \
+        } \
+        if (alpha) { \
+            uint32_t max = sizeof(dst_type) == 1 ? 0xff : 0xffff; \
+            r = unpremultiply(r, a, max); \
+            g = unpremultiply(g, a, max); \
+            b = unpremultiply(b, a, max); \
+        } \
+        (d)[0] = r; \
+        (d)[1] = g; \
+        (d)[2] = b; \
+        if ((dst_channels) == 4) \
+            (d)[3] = a; \
+    } while (0)
+
+// Converts `rows` rows of `width` pixels into a tightly packed destination.
+typedef void (*convert_fn)(
+  const uint8_t* restrict src, uint8_t* restrict dst, int width, int rows, int stride);
+
+// Expands to name_strided and name_packed. The packed variant is used when the stride has no
+// padding and runs the whole band as one flat loop. Every parameter of the inner loops is a
+// compile-time constant, so neither variant branches per pixel. At -O3 GCC loop-vectorizes the
+// opaque 8888 and 2101010 kernels except the two to RGB8, whose 3-byte output stride only gets
+// basic-block vectorization; the half-float kernels are bound by their table lookups and the
+// alpha kernels by the un-premultiply division.
+#define DEFINE_CONVERT(name, src_bpp, LOAD, src_bits, alpha, dst_type, dst_channels) \
+    static void name##_strided(const uint8_t* restrict src, uint8_t* restrict dst, int width, \
+      int rows, int stride) { \
+        for (int y = 0; y < rows; y++) { \
+            const uint8_t* restrict s = src + (size_t)y * stride; \
+            dst_type* restrict d = (dst_type*)dst + (size_t)y * width * (dst_channels); \
+            for (int x = 0; x < width; x++) \
+                CONVERT_PIXEL(LOAD, src_bits, alpha, dst_type, dst_channels, \
+                  s + (size_t)x * (src_bpp), d + (size_t)x * (dst_channels)); \
+        } \
+    } \
+    static void name##_packed(const uint8_t* restrict src, uint8_t* restrict dst, int width, \
+      int rows, int stride) { \
+        dst_type* restrict d = (dst_type*)dst; \
+        size_t n = (size_t)width * rows; \
+        (void)stride; \
+        for (size_t i = 0; i < n; i++) \
+            CONVERT_PIXEL(LOAD, src_bits, alpha, dst_type, dst_channels, src + i * (src_bpp), \
+              d + i * (dst_channels)); \
+    }
+
+// Each format converts to its own layout and to every wider one a composite may promote it to.
+DEFINE_CONVERT(convert_xrgb8888_rgb8, 4, LOAD_XRGB8888, 8, 0, uint8_t, 3)
+DEFINE_CONVERT(convert_xrgb8888_rgba8, 4, LOAD_XRGB8888, 8, 0, uint8_t, 4)
+DEFINE_CONVERT(convert_xrgb8888_rgb16, 4, LOAD_XRGB8888, 8, 0, uint16_t, 3)
+DEFINE_CONVERT(convert_xrgb8888_rgba16, 4, LOAD_XRGB8888, 8, 0, uint16_t, 4)
+DEFINE_CONVERT(convert_argb8888_rgba8, 4, LOAD_ARGB8888, 8, 1, uint8_t, 4)
+DEFINE_CONVERT(convert_argb8888_rgba16, 4, LOAD_ARGB8888, 8, 1, uint16_t, 4)
+DEFINE_CONVERT(convert_xbgr8888_rgb8, 4, LOAD_XBGR8888, 8, 0, uint8_t, 3)
+DEFINE_CONVERT(convert_xbgr8888_rgba8, 4, LOAD_XBGR8888, 8, 0, uint8_t, 4)
+DEFINE_CONVERT(convert_xbgr8888_rgb16, 4, LOAD_XBGR8888, 8, 0, uint16_t, 3)
+DEFINE_CONVERT(convert_xbgr8888_rgba16, 4, LOAD_XBGR8888, 8, 0, uint16_t, 4)
+DEFINE_CONVERT(convert_abgr8888_rgba8, 4, LOAD_ABGR8888, 8, 1, uint8_t, 4)
+DEFINE_CONVERT(convert_abgr8888_rgba16, 4, LOAD_ABGR8888, 8, 1, uint16_t, 4)
+DEFINE_CONVERT(convert_xrgb2101010_rgb16, 4, LOAD_XRGB2101010, 16, 0, uint16_t, 3)
+DEFINE_CONVERT(convert_xrgb2101010_rgba16, 4, LOAD_XRGB2101010, 16, 0, uint16_t, 4)
+DEFINE_CONVERT(convert_argb2101010_rgba16, 4, LOAD_ARGB2101010, 16, 1, uint16_t, 4)
+DEFINE_CONVERT(convert_xbgr2101010_rgb16, 4, LOAD_XBGR2101010, 16, 0, uint16_t, 3)
+DEFINE_CONVERT(convert_xbgr2101010_rgba16, 4, LOAD_XBGR2101010, 16, 0, uint16_t, 4)
+DEFINE_CONVERT(convert_abgr2101010_rgba16, 4, LOAD_ABGR2101010, 16, 1, uint16_t, 4)
+DEFINE_CONVERT(convert_xbgr16161616f_rgb16, 8, LOAD_XBGR16161616F, 16, 0, uint16_t, 3)
+DEFINE_CONVERT(convert_xbgr16161616f_rgba16, 8, LOAD_XBGR16161616F, 16, 0, uint16_t, 4)
+DEFINE_CONVERT(convert_abgr16161616f_rgba16, 8, LOAD_ABGR16161616F, 16, 1, uint16_t, 4)
+
+#define CONVERT(name) { name##_strided, name##_packed }
+
+// Rows converted per kernel call, so the per-call overhead is amortized over a band.
+#define CONVERT_BAND_ROWS 16
+
+struct pixel_format {
+    uint32_t shm_format;
+    int depth; // bits per source channel
+    int src_bpp; // bytes per shm pixel
+    enum pixel_layout layout; // layout of a frame of this format on its own
+    // { strided, packed } per layout; NULL for layouts narrower than the format's own
+    convert_fn convert[LAYOUT_COUNT][2];
+};
+
+// Alpha formats keep their alpha channel and the kernels un-premultiply it, so every format goes
+// through a kernel, even where the shm bytes would otherwise match the PNG layout.
+static const struct pixel_format pixel_formats[] = {
+    { WL_SHM_FORMAT_XRGB8888, 8, 4, LAYOUT_RGB8,
+      { [LAYOUT_RGB8] = CONVERT(convert_xrgb8888_rgb8),
+        [LAYOUT_RGBA8] = CONVERT(convert_xrgb8888_rgba8),
+        [LAYOUT_RGB16] = CONVERT(convert_xrgb8888_rgb16),
+        [LAYOUT_RGBA16] = CONVERT(convert_xrgb8888_rgba16) } },
+    { WL_SHM_FORMAT_ARGB8888, 8, 4, LAYOUT_RGBA8,
+      { [LAYOUT_RGBA8] = CONVERT(convert_argb8888_rgba8),
+        [LAYOUT_RGBA16] = CONVERT(convert_argb8888_rgba16) } },
+    { WL_SHM_FORMAT_XBGR8888, 8, 4, LAYOUT_RGB8,
+      { [LAYOUT_RGB8] = CONVERT(convert_xbgr8888_rgb8),
+        [LAYOUT_RGBA8] = CONVERT(convert_xbgr8888_rgba8),
+        [LAYOUT_RGB16] = CONVERT(convert_xbgr8888_rgb16),
+        [LAYOUT_RGBA16] = CONVERT(convert_xbgr8888_rgba16) } },
+    { WL_SHM_FORMAT_ABGR8888, 8, 4, LAYOUT_RGBA8,
+      { [LAYOUT_RGBA8] = CONVERT(convert_abgr8888_rgba8),
+        [LAYOUT_RGBA16] = CONVERT(convert_abgr8888_rgba16) } },
+    { WL_SHM_FORMAT_XRGB2101010, 10, 4, LAYOUT_RGB16,
+      { [LAYOUT_RGB16] = CONVERT(convert_xrgb2101010_rgb16),
+        [LAYOUT_RGBA16] = CONVERT(convert_xrgb2101010_rgba16) } },
+    { WL_SHM_FORMAT_ARGB2101010, 10, 4, LAYOUT_RGBA16,
+      { [LAYOUT_RGBA16] = CONVERT(convert_argb2101010_rgba16) } },
+    { WL_SHM_FORMAT_XBGR2101010, 10, 4, LAYOUT_RGB16,
+      { [LAYOUT_RGB16] = CONVERT(convert_xbgr2101010_rgb16),
+        [LAYOUT_RGBA16] = CONVERT(convert_xbgr2101010_rgba16) } },
+    { WL_SHM_FORMAT_ABGR2101010, 10, 4, LAYOUT_RGBA16,
+      { [LAYOUT_RGBA16] = CONVERT(convert_abgr2101010_rgba16) } },
+    { WL_SHM_FORMAT_XBGR16161616F, 16, 8, LAYOUT_RGB16,
+      { [LAYOUT_RGB16] = CONVERT(convert_xbgr16161616f_rgb16),
+        [LAYOUT_RGBA16] = CONVERT(convert_xbgr16161616f_rgba16) } },
+    { WL_SHM_FORMAT_ABGR16161616F, 16, 8, LAYOUT_RGBA16,
+      { [LAYOUT_RGBA16] = CONVERT(convert_abgr16161616f_rgba16) } },
+};
+
+static const struct pixel_format* find_pixel_format(uint32_t shm_format) {
+    for (size_t i = 0; i < sizeof(pixel_formats) / sizeof(pixel_formats[0]); i++)
+        if (pixel_formats[i].shm_format == shm_format)
+            return &pixel_formats[i];
+    return NULL;
+}
+
+// zlib/filter settings ordered from fastest to smallest output.
+struct encode_setting {
+    int level;
+    int strategy;
+    int filters;
+    const char* name;
+};
+
+static const struct encode_setting encode_settings[] = {
+    { 1, Z_RLE, PNG_FILTER_NONE, "level 1, rle, no filter" },
+    { 1, Z_RLE, PNG_FILTER_SUB, "level 1, rle, sub" },
+    { 2, Z_FILTERED, PNG_FILTER_SUB, "level 2, filtered, sub" },
+    { 4, Z_FILTERED, PNG_FILTER_SUB | PNG_FILTER_UP, "level 4, filtered, sub+up" },
+    { 6, Z_FILTERED, PNG_ALL_FILTERS, "level 6, filtered, all" },
+    { 9, Z_DEFAULT_STRATEGY, PNG_ALL_FILTERS, "level 9, default, all" },
+};
+
+#define ENCODE_SETTING_COUNT (int)(sizeof(encode_settings) / sizeof(encode_settings[0]))
+
+struct encode_stats {
+    double encode_ms;
+    size_t raw_size; // bytes of converted pixel data fed to libpng
+    size_t png_size;
+};
+
+// Picks the smallest-output setting whose encode time fits the budget. After each frame it steps
+// to a faster setting when over budget and to a slower one when the frame used less than half of
+// it, which leaves room for the slower setting without oscillating. The compression ratio last
+// measured at each setting stops the climb where the slower setting did not shrink the output, and
+// steps back down when the faster setting below compressed at least as well.
+struct latency_controller {
+    double budget_ms; // 0 when --latency-budget is not given
+    int index;
+    double ratio[ENCODE_SETTING_COUNT]; // raw_size / png_size last seen at each setting, 0 if none
+};
+
+static struct latency_controller latency = { 0, 2, { 0 } };
+
+static const struct encode_setting* latency_controller_setting(const struct latency_controller* c) {
+    return c->budget_ms > 0 ? &encode_settings[c->index] : NULL;
+}
+
+static void latency_controller_update(struct latency_controller* c, const struct encode_stats* st) {
+    if (c->budget_ms <= 0)
+        return;
+    if (st->png_size)
+        c->ratio[c->index] = (double)st->raw_size / st->png_size;
+    const double* ratio = c->ratio;
+    int i = c->index;
+    if (st->encode_ms > c->budget_ms && i > 0)
+        c->index--;
+    else if (i > 0 && ratio[i] && ratio[i - 1] >= ratio[i])
+        c->index--;
+    else if (st->encode_ms < c->budget_ms / 2 && i < ENCODE_SETTING_COUNT - 1
+      && (!ratio[i + 1] || ratio[i + 1] > ratio[i]))
+        c->index++;
+}
+
+static double elapsed_ms(const struct timespec* start, const struct timespec* end) {
+    return (end->tv_sec - start->tv_sec) * 1e3 + (end->tv_nsec - start->tv_nsec) / 1e6;
+}
+
+static int64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Converts rows [y, y + n) of the image into band, which holds CONVERT_BAND_ROWS tightly packed
+// rows of the image's layout. Returns -1 to abort the encode.
+typedef int (*fill_band_fn)(void* user, int y, int n, png_bytep band);
+
+// Streams an image to path one band at a time, so no converted copy of a whole image is ever held.
+// The image is written next to path and renamed over it once complete, so a failed encode leaves
+// no truncated file behind. A NULL setting keeps libpng's defaults; stats may be NULL.
+int process_pixels(const char* path, int width, int height, enum pixel_layout layout,
+  fill_band_fn fill, void* user, const struct encode_setting* setting, struct encode_stats* stats) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    const struct layout_info* li = &layouts[layout];
+    size_t row_size = (size_t)width * li->bpp;
+    png_bytep band = malloc(row_size * CONVERT_BAND_ROWS);
+    char* tmp_path = malloc(strlen(path) + sizeof(".tmp"));
+    if (!band || !tmp_path) {
+        fprintf(stderr, "Failed to allocate row buffer\n");
+        free(band);
+        free(tmp_path);
+        return -1;
+    }
+    sprintf(tmp_path, "%s.tmp", path);
+
+    FILE* f = fopen(tmp_path, "wb");
     if (!f) {
         perror("fopen");
-        return;
+        free(band);
+        free(tmp_path);
+        return -1;
     }
+    png_infop info_ptr = NULL;
     png_structp png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
     if (!png_ptr) {
         fprintf(stderr, "Could not allocate write struct\n");
-        fclose(f);
+        goto fail;
     }
 
     // Create info struct
-    png_infop info_ptr = png_create_info_struct(png_ptr);
+    info_ptr = png_create_info_struct(png_ptr);
     if (!info_ptr) {
         fprintf(stderr, "Could not allocate info struct\n");
-        png_destroy_write_struct(&png_ptr, (png_infopp)NULL);
-        fclose(f);
+        goto fail;
     }
 
     if (setjmp(png_jmpbuf(png_ptr))) {
         fprintf(stderr, "Error during png creation\n");
-        png_destroy_write_struct(&png_ptr, &info_ptr);
-        fclose(f);
+        goto fail;
     }
     png_init_io(png_ptr, f);
+    if (setting) {
+        png_set_compression_level(png_ptr, setting->level);
+        png_set_compression_strategy(png_ptr, setting->strategy);
+        png_set_filter(png_ptr, PNG_FILTER_TYPE_BASE, setting->filters);
+    }
 
-    // Write header (8 bit color depth)
-    png_set_IHDR(png_ptr, info_ptr, width, height, 8, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE,
-      PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+    // Write header (8 or 16 bit color depth)
+    png_set_IHDR(png_ptr, info_ptr, width, height, li->bit_depth, li->color_type,
+      PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
 
     png_write_info(png_ptr, info_ptr);
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+    if (li->bit_depth == 16)
+        png_set_swap(png_ptr);
+#endif
 
-    uint8_t* ndata = (uint8_t*)data;
-    for (int y = 0; y < height; y++) {
-        png_bytep row = malloc(width * 3);
-        if (!row) {
-            fprintf(stderr, "Failed to allocate row buffer\n");
-            break;
-        }
-        for (int x = 0; x < width; x++) {
-            row[x * 3 + 0] = ndata[y * stride + x * 4 + 2];
-            row[x * 3 + 1] = ndata[y * stride + x * 4 + 1];
-            row[x * 3 + 2] = ndata[y * stride + x * 4 + 0];
-        }
-        png_write_row(png_ptr, row);
-        free(row);
+    png_bytep rows[CONVERT_BAND_ROWS];
+    for (int i = 0; i < CONVERT_BAND_ROWS; i++)
+        rows[i] = band + i * row_size;
+    for (int y = 0; y < height; y += CONVERT_BAND_ROWS) {
+        int n = height - y < CONVERT_BAND_ROWS ? height - y : CONVERT_BAND_ROWS;
+        if (fill(user, y, n, band) < 0)
+            goto fail;
+        png_write_rows(png_ptr, rows, n);
     }
 
     png_write_end(png_ptr, info_ptr);
 
     // Cleanup
+    png_destroy_write_struct(&png_ptr, &info_ptr);
+    free(band);
+    long png_size = ftell(f);
+    if (fclose(f) != 0) {
+        perror("fclose");
+        remove(tmp_path);
+        free(tmp_path);
+        return -1;
+    }
+    if (rename(tmp_path, path) != 0) {
+        perror("rename");
+        remove(tmp_path);
+        free(tmp_path);
+        return -1;
+    }
+    free(tmp_path);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (stats) {
+        stats->encode_ms = elapsed_ms(&start, &end);
+        stats->raw_size = row_size * height;
+        stats->png_size = png_size > 0 ? (size_t)png_size : 0;
+    }
+    return 0;
+
+fail:
     png_destroy_write_struct(&png_ptr, &info_ptr);
     fclose(f);
+    remove(tmp_path);
+    free(tmp_path);
+    free(band);
+    return -1;
+}
+
+// Kernel converting this frame's shm rows to its format's own layout.
+static convert_fn frame_kernel(const struct frame_data* fdata) {
+    const struct pixel_format* pfmt = fdata->pfmt;
+    return pfmt->convert[pfmt->layout][fdata->stride == fdata->width * pfmt->src_bpp];
+}
+
+// One whole frame feeding the encoder.
+struct frame_rows {
+    const struct frame_data* fdata;
+    convert_fn convert; // picked once per frame
+    size_t released; // bytes from the start of the mapping already discarded
+};
+
+static int frame_fill_band(void* user, int y, int n, png_bytep band) {
+    struct frame_rows* fr = user;
+    const struct frame_data* fdata = fr->fdata;
+    const uint8_t* data = (const uint8_t*)fdata->shm_data + (size_t)y * fdata->stride;
+
+    // Rows above y have been encoded; hand their pages back to the kernel so memory held for large
+    // frames shrinks while the encode proceeds.
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t done = ((size_t)y * fdata->stride) & ~(page - 1);
+    if (done > fr->released) {
+        madvise((uint8_t*)fdata->shm_data + fr->released, done - fr->released, MADV_REMOVE);
+        fr->released = done;
+    }
+
+    fr->convert(data, band, fdata->width, n, fdata->stride);
+    return 0;
+}
+
+// Encodes one frame in its format's own layout. The shm rows are discarded as they are encoded, so
+// the frame cannot be read again afterwards.
+static int encode_frame(const struct frame_data* fdata, const char* path,
+  const struct encode_setting* setting, struct encode_stats* stats) {
+    struct frame_rows fr = { fdata, frame_kernel(fdata), 0 };
+    return process_pixels(path, fdata->width, fdata->height, fdata->pfmt->layout, frame_fill_band,
+      &fr, setting, stats);
 }
 
 static void frame_buffer(void* data, struct zwlr_screencopy_frame_v1* frame, uint32_t format,
@@ -115,84 +611,642 @@ static const struct zwlr_screencopy_frame_v1_listener frame_listener = {
 
 };
 
+// Reference image for --reference, held in the layout the encoder is fed (converted rows), so
+// frames are compared without a PNG round trip. Raw files
+// must already be in that layout, tightly packed, and are mapped directly; PNG files are decoded
+// into it once and kept for every later frame.
+struct reference_image {
+    const char* path; // NULL when no comparison is requested
+    const char* diff_path; // optional mismatch mask output
+    unsigned tolerance; // per-channel difference ignored, in 8-bit units
+    const struct pixel_format* pfmt;
+    int width, height;
+    uint8_t* pixels;
+    size_t size;
+    int mapped;
+};
+
+static struct reference_image reference = { 0 };
+
+static int reference_decode_png(struct reference_image* ref, FILE* f) {
+    const struct pixel_format* pfmt = ref->pfmt;
+    const struct layout_info* li = &layouts[pfmt->layout];
+    png_structp png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    if (!png_ptr) {
+        fprintf(stderr, "Could not allocate read struct\n");
+        return -1;
+    }
+    png_infop info_ptr = png_create_info_struct(png_ptr);
+    if (!info_ptr) {
+        fprintf(stderr, "Could not allocate info struct\n");
+        png_destroy_read_struct(&png_ptr, NULL, NULL);
+        return -1;
+    }
+    if (setjmp(png_jmpbuf(png_ptr))) {
+        fprintf(stderr, "Error decoding reference %s\n", ref->path);
+        png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+        return -1;
+    }
+    png_init_io(png_ptr, f);
+    png_read_info(png_ptr, info_ptr);
+    if ((int)png_get_image_width(png_ptr, info_ptr) != ref->width
+      || (int)png_get_image_height(png_ptr, info_ptr) != ref->height) {
+        fprintf(stderr, "Reference is %ux%u, frame is %dx%d\n",
+          png_get_image_width(png_ptr, info_ptr), png_get_image_height(png_ptr, info_ptr),
+          ref->width, ref->height);
+        png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+        return -1;
+    }
+
+    // Bring any PNG layout to the one the encoder would have been given for this frame.
+    int color_type = png_get_color_type(png_ptr, info_ptr);
+    png_set_expand(png_ptr);
+    if (!(color_type & PNG_COLOR_MASK_COLOR))
+        png_set_gray_to_rgb(png_ptr);
+    if (li->bit_depth == 8)
+        png_set_strip_16(png_ptr);
+    else
+        png_set_expand_16(png_ptr);
+    if (li->color_type == PNG_COLOR_TYPE_RGBA)
+        png_set_add_alpha(png_ptr, 0xffff, PNG_FILLER_AFTER);
+    else
+        png_set_strip_alpha(png_ptr);
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+    if (li->bit_depth == 16)
+        png_set_swap(png_ptr);
+#endif
+    int passes = png_set_interlace_handling(png_ptr);
+    png_read_update_info(png_ptr, info_ptr);
+
+    size_t row_size = (size_t)ref->width * li->bpp;
+    if (png_get_rowbytes(png_ptr, info_ptr) != row_size) {
+        fprintf(stderr, "Reference %s has an unexpected row layout\n", ref->path);
+        png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+        return -1;
+    }
+    for (int pass = 0; pass < passes; pass++)
+        for (int y = 0; y < ref->height; y++)
+            png_read_row(png_ptr, ref->pixels + y * row_size, NULL);
+    png_read_end(png_ptr, NULL);
+    png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+    return 0;
+}
+
+static void reference_release(struct reference_image* ref) {
+    if (ref->mapped)
+        munmap(ref->pixels, ref->size);
+    else
+        free(ref->pixels);
+    ref->pixels = NULL;
+    ref->pfmt = NULL;
+}
+
+// Loads the reference for frames of this format and size, reusing the cached copy when it already
+// matches.
+static int reference_load(
+  struct reference_image* ref, const struct pixel_format* pfmt, int width, int height) {
+    if (ref->pixels && ref->pfmt == pfmt && ref->width == width && ref->height == height)
+        return 0;
+    if (ref->pixels)
+        reference_release(ref);
+
+    int fd = open(ref->path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        perror(ref->path);
+        return -1;
+    }
+    uint8_t sig[8];
+    ssize_t n = pread(fd, sig, sizeof(sig), 0);
+    ref->pfmt = pfmt;
+    ref->width = width;
+    ref->height = height;
+    ref->size = (size_t)width * height * layouts[pfmt->layout].bpp;
+
+    if (n == sizeof(sig) && png_sig_cmp(sig, 0, sizeof(sig)) == 0) {
+        FILE* f = fdopen(fd, "rb");
+        if (!f) {
+            perror("fdopen");
+            close(fd);
+            return -1;
+        }
+        ref->mapped = 0;
+        ref->pixels = malloc(ref->size);
+        if (!ref->pixels) {
+            fprintf(stderr, "Failed to allocate reference buffer\n");
+            fclose(f);
+            return -1;
+        }
+        int ret = reference_decode_png(ref, f);
+        fclose(f);
+        if (ret < 0)
+            reference_release(ref);
+        return ret;
+    }
+
+    off_t file_size = lseek(fd, 0, SEEK_END);
+    if (file_size != (off_t)ref->size) {
+        fprintf(stderr, "Raw reference %s is %lld bytes, expected %zu\n", ref->path,
+          (long long)file_size, ref->size);
+        close(fd);
+        return -1;
+    }
+    void* pixels = mmap(NULL, ref->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (pixels == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+    ref->mapped = 1;
+    ref->pixels = pixels;
+    return 0;
+}
+
+#define DIFF_TILE 64
+
+// Sets mask[x] to 1 for every pixel with a channel differing by more than tolerance and returns
+// the number of such pixels, for a span of at most DIFF_TILE pixels. One kernel per encoder
+// layout. The absolute difference (max minus min) is taken over the span's samples as one flat
+// array and only then folded per pixel: GCC vectorizes the sample loop for all four layouts, the
+// fold only for the four-channel ones.
+typedef long (*diff_fn)(const uint8_t* restrict a, const uint8_t* restrict b, int width,
+  unsigned tolerance, uint8_t* restrict mask);
+
+#define DEFINE_DIFF(name, type, channels, tol_scale)                                              \
+    static long name(const uint8_t* restrict a, const uint8_t* restrict b, int width,           \
+      unsigned tolerance, uint8_t* restrict mask) {                                               \
+        const type* pa = (const type*)a;                                                          \
+        const type* pb = (const type*)b;                                                          \
+        const type tol = tolerance * tol_scale;                                                   \
+        uint8_t over[DIFF_TILE * channels];                                                       \
+        int n = width * channels;                                                                 \
+        for (int i = 0; i < n; i++) {                                                             \
+            type va = pa[i], vb = pb[i];                                                          \
+            type d = (va > vb ? va : vb) - (va < vb ? va : vb);                                   \
+            over[i] = d > tol;                                                                    \
+        }                                                                                         \
+        long count = 0;                                                                           \
+        for (int x = 0; x < width; x++) {                                                         \
+            uint8_t m = 0;                                                                        \
+            for (int c = 0; c < channels; c++)                                                    \
+                m |= over[x * channels + c];                                                      \
+            mask[x] = m;                                                                          \
+            count += m;                                                                           \
+        }                                                                                         \
+        return count;                                                                             \
+    }
+
+DEFINE_DIFF(diff_rgb8, uint8_t, 3, 1)
+DEFINE_DIFF(diff_rgba8, uint8_t, 4, 1)
+DEFINE_DIFF(diff_rgb16, uint16_t, 3, 257)
+DEFINE_DIFF(diff_rgba16, uint16_t, 4, 257)
+
+static const diff_fn diff_kernels[LAYOUT_COUNT] = {
+    [LAYOUT_RGB8] = diff_rgb8,
+    [LAYOUT_RGBA8] = diff_rgba8,
+    [LAYOUT_RGB16] = diff_rgb16,
+    [LAYOUT_RGBA16] = diff_rgba16,
+};
+
+struct diff_tile {
+    long count;
+    int x0, y0, x1, y1; // inclusive pixel bounds of the mismatches
+    int region;
+};
+
+// Mismatch mask written as a palette PNG while the frame is scanned, with mismatching pixels in
+// red on black. The mask rows double as the palette indices, so nothing is expanded per pixel.
+struct diff_image {
+    FILE* f;
+    png_structp png_ptr;
+    png_infop info_ptr;
+    uint8_t* blank; // all-zero row for rows without mismatches
+    int next_row; // rows before this one have been written
+};
+
+static int diff_image_close(struct diff_image* img) {
+    png_destroy_write_struct(&img->png_ptr, &img->info_ptr);
+    free(img->blank);
+    return fclose(img->f);
+}
+
+static int diff_image_open(struct diff_image* img, const char* path, int width, int height) {
+    img->blank = calloc(width, 1);
+    if (!img->blank) {
+        fprintf(stderr, "Failed to allocate diff row\n");
+        return -1;
+    }
+    img->f = fopen(path, "wb");
+    if (!img->f) {
+        perror("fopen");
+        free(img->blank);
+        return -1;
+    }
+    img->png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    if (!img->png_ptr) {
+        fprintf(stderr, "Could not allocate write struct\n");
+        free(img->blank);
+        fclose(img->f);
+        return -1;
+    }
+    img->info_ptr = png_create_info_struct(img->png_ptr);
+    if (!img->info_ptr) {
+        fprintf(stderr, "Could not allocate info struct\n");
+        png_destroy_write_struct(&img->png_ptr, (png_infopp)NULL);
+        free(img->blank);
+        fclose(img->f);
+        return -1;
+    }
+    if (setjmp(png_jmpbuf(img->png_ptr))) {
+        fprintf(stderr, "Error during png creation\n");
+        diff_image_close(img);
+        return -1;
+    }
+    png_init_io(img->png_ptr, img->f);
+    png_set_IHDR(img->png_ptr, img->info_ptr, width, height, 8, PNG_COLOR_TYPE_PALETTE,
+      PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+    png_color palette[2] = { { 0, 0, 0 }, { 255, 0, 0 } };
+    png_set_PLTE(img->png_ptr, img->info_ptr, palette, 2);
+    png_write_info(img->png_ptr, img->info_ptr);
+    img->next_row = 0;
+    return 0;
+}
+
+// Writes blank rows up to y.
+static void diff_image_fill(struct diff_image* img, int y) {
+    while (img->next_row < y) {
+        png_write_row(img->png_ptr, img->blank);
+        img->next_row++;
+    }
+}
+
+struct diff_scan {
+    const struct frame_data* fdata;
+    const struct reference_image* ref;
+    diff_fn diff;
+    uint8_t* mask;
+    struct diff_tile* tiles;
+    int tiles_x;
+    struct diff_image* image; // NULL without --diff-output
+    long mismatched;
+};
+
+// Compares one row tile span by tile span: spans that are byte-identical are skipped with memcmp
+// and only the others get the per-pixel pass. The mask row is written to the diff image as it is
+// produced.
+static void diff_scan_row(struct diff_scan* scan, int y, const uint8_t* row, const uint8_t* ref_row) {
+    int width = scan->fdata->width;
+    int bpp = layouts[scan->fdata->pfmt->layout].bpp;
+    struct diff_tile* tile_row = scan->tiles + (size_t)(y / DIFF_TILE) * scan->tiles_x;
+    long row_count = 0;
+    for (int x0 = 0; x0 < width; x0 += DIFF_TILE) {
+        int w = width - x0 < DIFF_TILE ? width - x0 : DIFF_TILE;
+        size_t off = (size_t)x0 * bpp;
+        uint8_t* mask = scan->mask + x0;
+        if (memcmp(row + off, ref_row + off, (size_t)w * bpp) == 0) {
+            memset(mask, 0, w);
+            continue;
+        }
+        long n = scan->diff(row + off, ref_row + off, w, scan->ref->tolerance, mask);
+        if (!n)
+            continue;
+        row_count += n;
+        struct diff_tile* t = &tile_row[x0 / DIFF_TILE];
+        int first = 0, last = w - 1;
+        while (!mask[first])
+            first++;
+        while (!mask[last])
+            last--;
+        if (!t->count) {
+            t->x0 = x0 + first;
+            t->x1 = x0 + last;
+            t->y0 = y;
+        }
+        t->count += n;
+        t->x0 = x0 + first < t->x0 ? x0 + first : t->x0;
+        t->x1 = x0 + last > t->x1 ? x0 + last : t->x1;
+        t->y1 = y;
+    }
+    if (!row_count)
+        return;
+    scan->mismatched += row_count;
+    if (scan->image) {
+        diff_image_fill(scan->image, y);
+        png_write_row(scan->image->png_ptr, scan->mask);
+        scan->image->next_row++;
+    }
+}
+
+// Visits the frame band by band in encoder layout, scanning every row that is not byte-identical
+// to the reference.
+static void diff_scan_frame(struct diff_scan* scan, png_bytep band) {
+    const struct frame_data* fdata = scan->fdata;
+    convert_fn convert = frame_kernel(fdata);
+    size_t row_size = (size_t)fdata->width * layouts[fdata->pfmt->layout].bpp;
+    const uint8_t* ndata = fdata->shm_data;
+    for (int y = 0; y < fdata->height; y += CONVERT_BAND_ROWS) {
+        int n = fdata->height - y < CONVERT_BAND_ROWS ? fdata->height - y : CONVERT_BAND_ROWS;
+        convert(ndata + (size_t)y * fdata->stride, band, fdata->width, n, fdata->stride);
+        for (int i = 0; i < n; i++) {
+            const uint8_t* row = band + i * row_size;
+            const uint8_t* ref_row = scan->ref->pixels + (size_t)(y + i) * row_size;
+            if (memcmp(row, ref_row, row_size) != 0)
+                diff_scan_row(scan, y + i, row, ref_row);
+        }
+    }
+}
+
+// Groups 4-connected mismatching tiles into regions and prints their bounding boxes.
+static void diff_report_regions(struct diff_tile* tiles, int tiles_x, int tiles_y) {
+    int ntiles = tiles_x * tiles_y;
+    int* stack = malloc(sizeof(int) * ntiles);
+    if (!stack) {
+        fprintf(stderr, "Failed to allocate region stack\n");
+        return;
+    }
+    int regions = 0;
+    for (int i = 0; i < ntiles; i++)
+        tiles[i].region = -1;
+    for (int i = 0; i < ntiles; i++) {
+        if (!tiles[i].count || tiles[i].region >= 0)
+            continue;
+        struct diff_tile box = tiles[i];
+        box.count = 0;
+        int top = 0;
+        stack[top++] = i;
+        tiles[i].region = regions;
+        while (top) {
+            int t = stack[--top];
+            int tx = t % tiles_x, ty = t / tiles_x;
+            box.count += tiles[t].count;
+            box.x0 = tiles[t].x0 < box.x0 ? tiles[t].x0 : box.x0;
+            box.y0 = tiles[t].y0 < box.y0 ? tiles[t].y0 : box.y0;
+            box.x1 = tiles[t].x1 > box.x1 ? tiles[t].x1 : box.x1;
+            box.y1 = tiles[t].y1 > box.y1 ? tiles[t].y1 : box.y1;
+            int neighbours[4] = { tx > 0 ? t - 1 : -1, tx < tiles_x - 1 ? t + 1 : -1,
+                ty > 0 ? t - tiles_x : -1, ty < tiles_y - 1 ? t + tiles_x : -1 };
+            for (int k = 0; k < 4; k++) {
+                int nb = neighbours[k];
+                if (nb >= 0 && tiles[nb].count && tiles[nb].region < 0) {
+                    tiles[nb].region = regions;
+                    stack[top++] = nb;
+                }
+            }
+        }
+        printf("  region %d: x %d, y %d, %dx%d, %ld pixels\n", regions, box.x0, box.y0,
+          box.x1 - box.x0 + 1, box.y1 - box.y0 + 1, box.count);
+        regions++;
+    }
+    free(stack);
+}
+
+// Compares the frame against the reference and reports mismatching pixels and regions, writing
+// the --diff-output mask in the same pass. The mask file is removed again if the frame matches.
+// Returns the number of mismatching pixels, or -1 on error.
+static long compare_frame(const struct frame_data* fdata, struct reference_image* ref) {
+    if (reference_load(ref, fdata->pfmt, fdata->width, fdata->height) < 0)
+        return -1;
+
+    int tiles_x = (fdata->width + DIFF_TILE - 1) / DIFF_TILE;
+    int tiles_y = (fdata->height + DIFF_TILE - 1) / DIFF_TILE;
+    png_bytep band
+      = malloc((size_t)fdata->width * layouts[fdata->pfmt->layout].bpp * CONVERT_BAND_ROWS);
+    uint8_t* mask = malloc(fdata->width);
+    struct diff_tile* tiles = calloc((size_t)tiles_x * tiles_y, sizeof(struct diff_tile));
+    if (!band || !mask || !tiles) {
+        fprintf(stderr, "Failed to allocate diff buffers\n");
+        free(band);
+        free(mask);
+        free(tiles);
+        return -1;
+    }
+
+    struct diff_image image;
+    struct diff_scan scan
+      = { fdata, ref, diff_kernels[fdata->pfmt->layout], mask, tiles, tiles_x, NULL, 0 };
+    if (ref->diff_path) {
+        if (diff_image_open(&image, ref->diff_path, fdata->width, fdata->height) == 0)
+            scan.image = &image;
+        else
+            fprintf(stderr, "Not writing diff to %s\n", ref->diff_path);
+    }
+    if (scan.image) {
+        if (setjmp(png_jmpbuf(image.png_ptr))) {
+            fprintf(stderr, "Error writing diff to %s\n", ref->diff_path);
+            diff_image_close(&image);
+            remove(ref->diff_path);
+            free(band);
+            free(mask);
+            free(tiles);
+            return -1;
+        }
+    }
+    diff_scan_frame(&scan, band);
+
+    if (scan.mismatched) {
+        printf("compare: %ld pixels differ from %s\n", scan.mismatched, ref->path);
+        diff_report_regions(tiles, tiles_x, tiles_y);
+    } else {
+        printf("compare: frame matches %s, encode skipped\n", ref->path);
+    }
+    if (scan.image) {
+        if (scan.mismatched) {
+            diff_image_fill(&image, fdata->height);
+            png_write_end(image.png_ptr, image.info_ptr);
+        }
+        if (diff_image_close(&image) != 0)
+            perror("fclose");
+        else if (scan.mismatched)
+            printf("compare: diff written to %s\n", ref->diff_path);
+        if (!scan.mismatched)
+            remove(ref->diff_path);
+    }
+
+    free(band);
+    free(mask);
+    free(tiles);
+    return scan.mismatched;
+}
+
 static void frame_buffer(void* data, struct zwlr_screencopy_frame_v1* frame, uint32_t format,
   uint32_t width, uint32_t height, uint32_t stride) {
     struct frame_data* fdata = data;
-    if (!fdata) {
-        fprintf(stderr, "Failed to allocate frame_data\n");
+    if (fdata->state != FRAME_NEGOTIATING)
+        return;
+    // Sent once per frame with the compositor's format; buffer_done fails the frame if we cannot
+    // convert it.
+    const struct pixel_format* pfmt = find_pixel_format(format);
+    if (!pfmt) {
+        fprintf(stderr, "Unsupported shm format 0x%08x\n", format);
         return;
     }
+    if (pfmt->depth == 16)
+        init_half_table();
+    fdata->pfmt = pfmt;
     fdata->format = format;
     fdata->width = width;
     fdata->height = height;
     fdata->stride = stride;
-    fdata->size = stride * height;
+    fdata->size = (size_t)stride * height;
+}
 
+// On failure nothing is left allocated; the caller keeps ownership of fdata.
+static int create_buffer(struct frame_data* fdata) {
     int fd = create_shm_file(fdata->size);
     if (fd < 0) {
         fprintf(stderr, "Failed to create shm file\n");
-        free(fdata);
-        return;
+        return -1;
     }
 
-    fdata->shm_data = mmap(NULL, fdata->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    if (fdata->shm_data == MAP_FAILED) {
+    void* shm_data = mmap(NULL, fdata->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (shm_data == MAP_FAILED) {
         perror("mmap");
         close(fd);
-        free(fdata);
-        return;
+        return -1;
     }
     struct wl_shm_pool* pool = wl_shm_create_pool(wl_shm, fd, fdata->size);
-    fdata->buffer = wl_shm_pool_create_buffer(pool, 0, width, height, stride, WL_SHM_FORMAT_XRGB8888);
-    wl_shm_pool_destroy(pool);
     close(fd);
+    if (!pool) {
+        fprintf(stderr, "Failed to create shm pool\n");
+        munmap(shm_data, fdata->size);
+        return -1;
+    }
+    fdata->buffer = wl_shm_pool_create_buffer(
+      pool, 0, fdata->width, fdata->height, fdata->stride, fdata->format);
+    wl_shm_pool_destroy(pool);
+    if (!fdata->buffer) {
+        fprintf(stderr, "Failed to create wl_buffer\n");
+        munmap(shm_data, fdata->size);
+        return -1;
+    }
+    fdata->shm_data = shm_data;
+    return 0;
 }
 
 static void frame_ready(void* data, struct zwlr_screencopy_frame_v1* frame, uint32_t tv_sec_hi,
   uint32_t tv_sec_lo, uint32_t tv_nsec) {
     struct frame_data* fdata = data;
-    fprintf(stdout, "Frame ready, saving to capture.raw\n");
-    printf("w: %d, h: %d, stride: %d\n", fdata->width, fdata->height, fdata->stride);
-    process_pixels(
-      fdata->shm_data, fdata->width, fdata->height, fdata->stride, WL_SHM_FORMAT_XRGB8888);
-    munmap(fdata->shm_data, fdata->size);
-    wl_buffer_destroy(fdata->buffer);
-    zwlr_screencopy_frame_v1_destroy(frame);
-    free(fdata);
-    exit(0);
+    if (fdata->state != FRAME_COPYING)
+        return;
+    fdata->received_ns = now_ns();
+    fdata->presented_ns = (int64_t)(((uint64_t)tv_sec_hi << 32) | tv_sec_lo) * 1000000000 + tv_nsec;
+    fdata->state = FRAME_READY;
 }
 
 static void frame_failed(void* data, struct zwlr_screencopy_frame_v1* frame) {
     struct frame_data* fdata = data;
-    fprintf(stderr, "Frame capture failed\n");
-    munmap(fdata->shm_data, fdata->size);
-    wl_buffer_destroy(fdata->buffer);
-    zwlr_screencopy_frame_v1_destroy(frame);
-    free(fdata);
-    exit(1);
+    fdata->state = FRAME_FAILED;
 }
 
 static void frame_linux_dmabuf(void* data, struct zwlr_screencopy_frame_v1* zwlr_screencopy_frame_v1,
-  uint32_t format, uint32_t width, uint32_t height) {
-    fprintf(stderr, "linux_dmabuf event received (ignored)\n");
-}
+  uint32_t format, uint32_t width, uint32_t height) {}
 static void buffer_done(void* data, struct zwlr_screencopy_frame_v1* zwlr_screencopy_frame_v1) {
     struct frame_data* fdata = data;
-    zwlr_screencopy_frame_v1_copy(frame, fdata->buffer);
-    fprintf(stdout, "buffer done event, copying\n");
+    if (fdata->state != FRAME_NEGOTIATING)
+        return;
+    if (!fdata->pfmt) {
+        fprintf(stderr, "No usable shm buffer offered\n");
+        fdata->state = FRAME_FAILED;
+        return;
+    }
+    if (create_buffer(fdata) < 0) {
+        fdata->state = FRAME_FAILED;
+        return;
+    }
+    zwlr_screencopy_frame_v1_copy(fdata->frame, fdata->buffer);
+    fdata->state = FRAME_COPYING;
 }
 static void flags_recieved(
-  void* data, struct zwlr_screencopy_frame_v1* zwlr_screencopy_frame_v1, uint32_t flags) {
-    fprintf(stdout, "flags recieved event, ignored\n");
+  void* data, struct zwlr_screencopy_frame_v1* zwlr_screencopy_frame_v1, uint32_t flags) {}
+
+// Takes ownership of frame, which may be NULL if the request could not be made.
+static struct frame_data* frame_data_start(struct zwlr_screencopy_frame_v1* frame) {
+    if (!frame) {
+        fprintf(stderr, "Failed to start capture\n");
+        return NULL;
+    }
+    struct frame_data* fdata = calloc(1, sizeof(struct frame_data));
+    if (!fdata) {
+        fprintf(stderr, "Failed to allocate frame_data\n");
+        zwlr_screencopy_frame_v1_destroy(frame);
+        return NULL;
+    }
+    fdata->frame = frame;
+    fdata->state = FRAME_NEGOTIATING;
+    zwlr_screencopy_frame_v1_add_listener(fdata->frame, &frame_listener, fdata);
+    return fdata;
+}
+
+static struct frame_data* frame_data_create(struct wl_output* target) {
+    return frame_data_start(zwlr_screencopy_manager_v1_capture_output(screencopy_manager, 1, target));
+}
+
+// Captures the part of target inside the given rectangle, in the output's logical coordinates.
+// The compositor clips it to the output.
+static struct frame_data* frame_data_create_region(
+  struct wl_output* target, int32_t x, int32_t y, int32_t width, int32_t height) {
+    return frame_data_start(zwlr_screencopy_manager_v1_capture_output_region(
+      screencopy_manager, 1, target, x, y, width, height));
+}
+
+// Releases everything the frame owns. Destroying the frame proxy first guarantees no further
+// events reference fdata.
+static void frame_data_destroy(struct frame_data* fdata) {
+    zwlr_screencopy_frame_v1_destroy(fdata->frame);
+    if (fdata->buffer)
+        wl_buffer_destroy(fdata->buffer);
+    if (fdata->shm_data)
+        munmap(fdata->shm_data, fdata->size);
+    free(fdata);
+}
+
+static void output_geometry(void* data, struct wl_output* wl_output, int32_t x, int32_t y,
+  int32_t physical_width, int32_t physical_height, int32_t subpixel, const char* make,
+  const char* model, int32_t transform) {
+    struct output_info* info = data;
+    info->x = x;
+    info->y = y;
+    info->transform = transform;
+}
+
+static void output_mode(void* data, struct wl_output* wl_output, uint32_t flags, int32_t width,
+  int32_t height, int32_t refresh) {
+    struct output_info* info = data;
+    if (!(flags & WL_OUTPUT_MODE_CURRENT))
+        return;
+    info->width = width;
+    info->height = height;
+    info->refresh = refresh;
 }
+static void output_done(void* data, struct wl_output* wl_output) {}
+static void output_scale(void* data, struct wl_output* wl_output, int32_t factor) {
+    struct output_info* info = data;
+    info->scale = factor;
+}
+static void output_name(void* data, struct wl_output* wl_output, const char* name) {}
+static void output_description(void* data, struct wl_output* wl_output, const char* description) {}
+
+static const struct wl_output_listener output_listener = {
+    .geometry = output_geometry,
+    .mode = output_mode,
+    .done = output_done,
+    .scale = output_scale,
+    .name = output_name,
+    .description = output_description,
+};
 
 static void global_handler(
   void* data, struct wl_registry* registry, uint32_t id, const char* interface, uint32_t version) {
     if (strcmp(interface, wl_compositor_interface.name) == 0)
         compositor = wl_registry_bind(registry, id, &wl_compositor_interface, 6);
-    else if (strcmp(interface, wl_output_interface.name) == 0)
+    else if (strcmp(interface, wl_output_interface.name) == 0) {
         output = wl_registry_bind(registry, id, &wl_output_interface, 4);
-    else if (strcmp(interface, zwlr_screencopy_manager_v1_interface.name) == 0)
+        if (output_count < MAX_OUTPUTS) {
+            struct output_info* info = &outputs[output_count++];
+            info->wl_output = output;
+            info->scale = 1;
+            wl_output_add_listener(info->wl_output, &output_listener, info);
+        }
+    } else if (strcmp(interface, zwlr_screencopy_manager_v1_interface.name) == 0)
         screencopy_manager = wl_registry_bind(registry, id, &zwlr_screencopy_manager_v1_interface, 3);
     else if (strcmp(interface, wl_shm_interface.name) == 0)
         wl_shm = wl_registry_bind(registry, id, &wl_shm_interface, 1);
@@ -205,7 +1259,504 @@ static const struct wl_registry_listener registry_listener = {
     .global_remove = global_remove_handler,
 };
 
-int main() {
+// Paces captures to a fixed rate on the output's presentation clock. Slot k is the presentation
+// time origin + k * period, where the origin is the first frame we receive, so targets never
+// drift. Each ready timestamp is mapped to its nearest slot: skipped slots count as dropped
+// intervals and a frame landing on an already filled slot is redundant and not saved.
+struct capture_scheduler {
+    int64_t period_ns; // 0 for a single capture
+    int64_t refresh_ns; // output refresh period, or period_ns if the mode did not report one
+    long count; // frames to save, 0 for no limit
+    int started;
+    int64_t origin_ns;
+    int64_t clock_offset_ns; // smallest receive time minus presentation time seen
+    int64_t lead_ns; // smallest request-to-presentation latency seen, in CLOCK_MONOTONIC
+    int64_t next_issue_ns; // CLOCK_MONOTONIC time to issue the next capture
+    int64_t last_slot;
+    long frames, dropped, redundant, failed;
+    int failed_in_row;
+    double jitter_sum_ms, jitter_max_ms;
+};
+
+static struct capture_scheduler scheduler = { 0 };
+
+// Consecutive failed frames after which a scheduled capture gives up.
+#define SCHEDULER_MAX_FAILURES 8
+
+// Requests go out the measured request-to-presentation latency before the slot so the copy lands
+// on the presentation at it.
+static int64_t scheduler_slot_issue(const struct capture_scheduler* s, int64_t slot) {
+    return s->origin_ns + slot * s->period_ns + s->clock_offset_ns - s->lead_ns;
+}
+
+// A redundant or failed frame is retried for the slot still being waited on, but no sooner than
+// a refresh after the previous request, so a compositor repeating its last presentation on a
+// static screen is not asked again before it can have a new one.
+static int64_t scheduler_retry(const struct capture_scheduler* s, int64_t requested_ns) {
+    int64_t backoff = requested_ns + s->refresh_ns;
+    if (!s->started)
+        return backoff;
+    int64_t issue = scheduler_slot_issue(s, s->last_slot + 1);
+    return issue > backoff ? issue : backoff;
+}
+
+// Returns the slot the frame fills, or -1 if it is redundant.
+static int64_t scheduler_on_ready(
+  struct capture_scheduler* s, int64_t requested_ns, const struct frame_data* fdata) {
+    int64_t offset = fdata->received_ns - fdata->presented_ns;
+    if (!s->started || offset < s->clock_offset_ns)
+        s->clock_offset_ns = offset;
+    int64_t lead = fdata->presented_ns + s->clock_offset_ns - requested_ns;
+    if (!s->started || lead < s->lead_ns)
+        s->lead_ns = lead;
+    s->failed_in_row = 0;
+    if (!s->started) {
+        s->started = 1;
+        s->origin_ns = fdata->presented_ns;
+        s->last_slot = 0;
+        s->frames = 1;
+        s->next_issue_ns = scheduler_slot_issue(s, 1);
+        return 0;
+    }
+
+    int64_t rel = fdata->presented_ns - s->origin_ns;
+    int64_t slot = rel >= 0 ? (rel + s->period_ns / 2) / s->period_ns : -1;
+    if (slot <= s->last_slot) {
+        // Nothing was presented since the last frame.
+        s->redundant++;
+        s->next_issue_ns = scheduler_retry(s, requested_ns);
+        return -1;
+    }
+    double jitter_ms = (rel - slot * s->period_ns) / 1e6;
+    double abs_jitter_ms = jitter_ms < 0 ? -jitter_ms : jitter_ms;
+    s->jitter_sum_ms += abs_jitter_ms;
+    if (abs_jitter_ms > s->jitter_max_ms)
+        s->jitter_max_ms = abs_jitter_ms;
+    s->dropped += slot - s->last_slot - 1;
+    s->frames++;
+    s->last_slot = slot;
+    s->next_issue_ns = scheduler_slot_issue(s, slot + 1);
+    return slot;
+}
+
+// Returns -1 once SCHEDULER_MAX_FAILURES frames in a row have failed, 0 otherwise.
+static int scheduler_on_failed(struct capture_scheduler* s, int64_t requested_ns) {
+    s->failed++;
+    s->next_issue_ns = scheduler_retry(s, requested_ns);
+    return ++s->failed_in_row < SCHEDULER_MAX_FAILURES ? 0 : -1;
+}
+
+static void sleep_until(int64_t deadline_ns) {
+    struct timespec ts = { deadline_ns / 1000000000, deadline_ns % 1000000000 };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+// Dispatches until the frame is ready or failed. Returns -1 if the connection was lost.
+static int frame_wait(struct wl_display* display, const struct frame_data* fdata) {
+    while (fdata->state < FRAME_READY) {
+        if (wl_display_dispatch(display) == -1) {
+            fprintf(stderr, "Lost connection to Wayland display\n");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Requests a frame and dispatches until it is ready or failed. Returns NULL if the capture could not
+// be started or the connection was lost.
+static struct frame_data* capture_frame(struct wl_display* display) {
+    struct frame_data* fdata = frame_data_create(output);
+    if (!fdata)
+        return NULL;
+    wl_display_flush(display);
+    if (frame_wait(display, fdata) < 0) {
+        frame_data_destroy(fdata);
+        return NULL;
+    }
+    return fdata;
+}
+
+static void report_encode(const struct encode_setting* setting, const struct encode_stats* stats) {
+    printf("encode: %.2f ms, %s, %zu -> %zu bytes (ratio %.2f)\n", stats->encode_ms,
+      setting ? setting->name : "libpng defaults", stats->raw_size, stats->png_size,
+      stats->png_size ? (double)stats->raw_size / stats->png_size : 0.0);
+    latency_controller_update(&latency, stats);
+}
+
+// Returns 1 if the frame differs from --reference, 0 if it was saved or matched, -1 on error.
+static int save_frame(const struct frame_data* fdata, const char* path) {
+    long mismatched = 0;
+    if (reference.path) {
+        mismatched = compare_frame(fdata, &reference);
+        if (mismatched <= 0)
+            return mismatched < 0 ? -1 : 0;
+    }
+    const struct encode_setting* setting = latency_controller_setting(&latency);
+    struct encode_stats stats;
+    if (encode_frame(fdata, path, setting, &stats) < 0)
+        return -1;
+    report_encode(setting, &stats);
+    return mismatched ? 1 : 0;
+}
+
+static int capture_once(struct wl_display* display) {
+    struct frame_data* fdata = capture_frame(display);
+    if (!fdata)
+        return 1;
+    int ret = 1;
+    if (fdata->state == FRAME_READY) {
+        fprintf(stdout, "Frame ready, saving to capture.png\n");
+        printf("w: %d, h: %d, stride: %d\n", fdata->width, fdata->height, fdata->stride);
+        int saved = save_frame(fdata, "capture.png");
+        if (saved >= 0)
+            ret = saved ? 2 : 0;
+    } else {
+        fprintf(stderr, "Frame capture failed\n");
+    }
+    frame_data_destroy(fdata);
+    return ret;
+}
+
+// Logical rows requested per strip of a composite. Each output holds the strip being converted and
+// the one requested below it, so memory stays bounded by two strips per output plus one encoder
+// band however large the outputs are.
+#define COMPOSITE_STRIP_ROWS 64
+
+// One output of a composite, captured strip by strip as the encoder reaches its rows. The next
+// strip is requested as soon as the current one is taken, so it is copied while the current one is
+// encoded.
+struct composite_source {
+    const struct output_info* info;
+    int x, y; // placement in the composite, buffer pixels
+    int width, height;
+    const struct pixel_format* pfmt; // from the first strip; later strips must match
+    int stride;
+    convert_fn convert; // picked once for the composite's layout
+    struct frame_data* strip; // NULL before the first strip
+    struct frame_data* pending; // requested strip below the current one, NULL past the last
+    int strip_y; // source row of the strip's first row
+    int strip_rows;
+    int next_y; // logical row the next requested strip starts at
+};
+
+struct composite {
+    struct wl_display* display;
+    struct composite_source sources[MAX_OUTPUTS];
+    int count;
+    int width, height;
+    enum pixel_layout layout;
+    int gaps; // some pixels are covered by no output, or outputs overlap
+    int64_t wait_ns; // spent waiting for strips, which is not encode time
+};
+
+// Requests the strip starting at next_y into pending, unless the output ends above it.
+static int composite_request_strip(struct composite_source* s) {
+    s->pending = NULL;
+    if (s->next_y * s->info->scale >= s->height)
+        return 0;
+    s->pending = frame_data_create_region(s->info->wl_output, 0, s->next_y,
+      s->width / s->info->scale, COMPOSITE_STRIP_ROWS);
+    if (!s->pending)
+        return -1;
+    s->next_y += COMPOSITE_STRIP_ROWS;
+    return 0;
+}
+
+// Replaces the source's strip with the pending one and requests the strip after it before waiting,
+// so the two copies overlap.
+static int composite_next_strip(struct composite* c, struct composite_source* s) {
+    if (s->strip) {
+        s->strip_y += s->strip_rows;
+        frame_data_destroy(s->strip);
+    }
+    s->strip = s->pending;
+    s->strip_rows = 0;
+    if (!s->strip) {
+        fprintf(stderr, "Output ended before its last row was captured\n");
+        return -1;
+    }
+    if (composite_request_strip(s) < 0)
+        return -1;
+    wl_display_flush(c->display);
+    int64_t wait_start = now_ns();
+    int lost = frame_wait(c->display, s->strip) < 0;
+    c->wait_ns += now_ns() - wait_start;
+    if (lost)
+        return -1;
+    const struct frame_data* strip = s->strip;
+    if (strip->state != FRAME_READY) {
+        fprintf(stderr, "Strip capture failed\n");
+        return -1;
+    }
+    if (!s->pfmt) {
+        s->pfmt = strip->pfmt;
+        s->stride = strip->stride;
+    }
+    if (strip->width != s->width || strip->pfmt != s->pfmt || strip->stride != s->stride
+      || strip->height <= 0) {
+        fprintf(stderr, "Output strip is %dx%d in format 0x%08x, expected width %d in 0x%08x\n",
+          strip->width, strip->height, strip->format, s->width, s->pfmt->shm_format);
+        return -1;
+    }
+    s->strip_rows = strip->height < s->height - s->strip_y ? strip->height : s->height - s->strip_y;
+    return 0;
+}
+
+// Converts the rows of every output that fall in the band, capturing strips as they are reached.
+static int composite_fill_band(void* user, int y, int n, png_bytep band) {
+    struct composite* c = user;
+    int bpp = layouts[c->layout].bpp;
+    size_t row_size = (size_t)c->width * bpp;
+    if (c->gaps)
+        memset(band, 0, row_size * n);
+    for (int k = 0; k < c->count; k++) {
+        struct composite_source* s = &c->sources[k];
+        int end = y + n < s->y + s->height ? y + n : s->y + s->height;
+        for (int row = y > s->y ? y : s->y; row < end;) {
+            int sy = row - s->y;
+            if (sy >= s->strip_y + s->strip_rows && composite_next_strip(c, s) < 0)
+                return -1;
+            int strip_end = s->strip_y + s->strip_rows - sy;
+            int m = end - row < strip_end ? end - row : strip_end;
+            const uint8_t* src
+              = (const uint8_t*)s->strip->shm_data + (size_t)(sy - s->strip_y) * s->stride;
+            png_bytep dst = band + (size_t)(row - y) * row_size + (size_t)s->x * bpp;
+            if (s->width == c->width) {
+                s->convert(src, dst, s->width, m, s->stride);
+            } else {
+                for (int i = 0; i < m; i++)
+                    s->convert(src + (size_t)i * s->stride, dst + i * row_size, s->width, 1,
+                      s->stride);
+            }
+            row += m;
+        }
+    }
+    return 0;
+}
+
+// Captures every output and stitches them into a single capture.png, each placed at its position
+// in the compositor's global space scaled to buffer pixels. Outputs are captured in strips of
+// COMPOSITE_STRIP_ROWS logical rows as the encoder reaches them, converted to a layout that holds
+// every output's format. Strips may be taken at different presentations, so content that changes
+// during the capture may tear at strip boundaries. Outputs must share one scale and the normal
+// transform, since placing them otherwise would need resampling or rotation.
+static int capture_composite(struct wl_display* display) {
+    struct composite c = { .display = display, .count = output_count };
+    int scale = outputs[0].scale;
+    int32_t min_x = outputs[0].x, min_y = outputs[0].y;
+    for (int i = 0; i < c.count; i++) {
+        const struct output_info* info = &outputs[i];
+        if (info->transform != WL_OUTPUT_TRANSFORM_NORMAL) {
+            fprintf(stderr, "Output %d is rotated or flipped, which composites do not support\n", i);
+            return 1;
+        }
+        if (info->scale != scale) {
+            fprintf(stderr, "Outputs have scales %d and %d; composites need a single scale\n",
+              scale, info->scale);
+            return 1;
+        }
+        if (info->width <= 0 || info->height <= 0) {
+            fprintf(stderr, "Output %d has no current mode\n", i);
+            return 1;
+        }
+        min_x = info->x < min_x ? info->x : min_x;
+        min_y = info->y < min_y ? info->y : min_y;
+    }
+    long long area = 0;
+    for (int i = 0; i < c.count; i++) {
+        struct composite_source* s = &c.sources[i];
+        s->info = &outputs[i];
+        s->x = (s->info->x - min_x) * scale;
+        s->y = (s->info->y - min_y) * scale;
+        s->width = s->info->width;
+        s->height = s->info->height;
+        c.width = s->x + s->width > c.width ? s->x + s->width : c.width;
+        c.height = s->y + s->height > c.height ? s->y + s->height : c.height;
+        area += (long long)s->width * s->height;
+        for (int j = 0; j < i; j++) {
+            const struct composite_source* o = &c.sources[j];
+            if (s->x < o->x + o->width && o->x < s->x + s->width && s->y < o->y + o->height
+              && o->y < s->y + s->height)
+                c.gaps = 1;
+        }
+    }
+    // Without overlaps, outputs tile the composite exactly when their areas add up to it.
+    c.gaps |= area != (long long)c.width * c.height;
+
+    // The first strips of all outputs are requested together, so a single presentation can serve
+    // them. Each tells its output's format; the layout is known before encoding starts.
+    int ret = 1;
+    int layout = LAYOUT_RGB8;
+    for (int i = 0; i < c.count; i++)
+        if (composite_request_strip(&c.sources[i]) < 0)
+            goto out;
+    for (int i = 0; i < c.count; i++) {
+        if (composite_next_strip(&c, &c.sources[i]) < 0)
+            goto out;
+        layout |= c.sources[i].pfmt->layout;
+    }
+    c.layout = layout;
+    for (int i = 0; i < c.count; i++) {
+        struct composite_source* s = &c.sources[i];
+        s->convert = s->pfmt->convert[c.layout][s->stride == s->width * s->pfmt->src_bpp];
+    }
+
+    printf("compositing %d outputs into %dx%d\n", c.count, c.width, c.height);
+    const struct encode_setting* setting = latency_controller_setting(&latency);
+    struct encode_stats stats;
+    c.wait_ns = 0;
+    if (process_pixels(
+          "capture.png", c.width, c.height, c.layout, composite_fill_band, &c, setting, &stats)
+      < 0)
+        goto out;
+    stats.encode_ms -= c.wait_ns / 1e6;
+    report_encode(setting, &stats);
+    ret = 0;
+
+out:
+    for (int i = 0; i < c.count; i++) {
+        if (c.sources[i].strip)
+            frame_data_destroy(c.sources[i].strip);
+        if (c.sources[i].pending)
+            frame_data_destroy(c.sources[i].pending);
+    }
+    return ret;
+}
+
+static int capture_scheduled(struct wl_display* display) {
+    struct capture_scheduler* s = &scheduler;
+    int ret = 0;
+    for (int i = 0; i < output_count; i++)
+        if (outputs[i].wl_output == output && outputs[i].refresh > 0)
+            s->refresh_ns = 1000000000000LL / outputs[i].refresh;
+    if (!s->refresh_ns)
+        s->refresh_ns = s->period_ns;
+    while (!s->count || s->frames < s->count) {
+        if (s->next_issue_ns > now_ns())
+            sleep_until(s->next_issue_ns);
+        int64_t requested_ns = now_ns();
+        struct frame_data* fdata = capture_frame(display);
+        if (!fdata) {
+            ret = 1;
+            break;
+        }
+        if (fdata->state == FRAME_READY) {
+            int64_t slot = scheduler_on_ready(s, requested_ns, fdata);
+            if (slot >= 0) {
+                char path[64];
+                snprintf(path, sizeof(path), "capture-%06lld.png", (long long)slot);
+                printf("frame %lld: jitter %+.3f ms, dropped %ld\n", (long long)slot,
+                  (fdata->presented_ns - s->origin_ns - slot * s->period_ns) / 1e6, s->dropped);
+                if (save_frame(fdata, path) < 0)
+                    ret = 1;
+            }
+        } else {
+            fprintf(stderr, "Frame capture failed\n");
+            if (scheduler_on_failed(s, requested_ns) < 0) {
+                fprintf(stderr, "Giving up after %d failed frames in a row\n", s->failed_in_row);
+                ret = 1;
+            }
+        }
+        frame_data_destroy(fdata);
+        if (s->failed_in_row >= SCHEDULER_MAX_FAILURES)
+            break;
+    }
+    printf("captured %ld frames, %ld dropped intervals, %ld redundant, %ld failed, "
+           "jitter mean %.3f ms max %.3f ms\n",
+      s->frames, s->dropped, s->redundant, s->failed,
+      s->frames > 1 ? s->jitter_sum_ms / (s->frames - 1) : 0.0, s->jitter_max_ms);
+    return ret;
+}
+
+static void usage(const char* argv0) {
+    fprintf(stderr,
+      "Usage: %s [--latency-budget ms] [--rate hz [--count n]]\n"
+      "       [--reference file [--tolerance n] [--diff-output file]] [--all-outputs]\n",
+      argv0);
+}
+
+int main(int argc, char** argv) {
+    static const struct option options[] = {
+        { "latency-budget", required_argument, NULL, 'l' },
+        { "rate", required_argument, NULL, 'r' },
+        { "count", required_argument, NULL, 'c' },
+        { "reference", required_argument, NULL, 'R' },
+        { "tolerance", required_argument, NULL, 't' },
+        { "diff-output", required_argument, NULL, 'd' },
+        { "all-outputs", no_argument, NULL, 'a' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 },
+    };
+    int all_outputs = 0;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "l:r:c:R:t:d:ah", options, NULL)) != -1) {
+        switch (opt) {
+            case 'l': {
+                char* end;
+                latency.budget_ms = strtod(optarg, &end);
+                if (*end || latency.budget_ms <= 0) {
+                    fprintf(stderr, "Invalid latency budget '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            }
+            case 'r': {
+                char* end;
+                double rate = strtod(optarg, &end);
+                if (*end || rate <= 0) {
+                    fprintf(stderr, "Invalid rate '%s'\n", optarg);
+                    return 1;
+                }
+                scheduler.period_ns = (int64_t)(1e9 / rate);
+                break;
+            }
+            case 'c': {
+                char* end;
+                scheduler.count = strtol(optarg, &end, 10);
+                if (*end || scheduler.count <= 0) {
+                    fprintf(stderr, "Invalid count '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            }
+            case 'R':
+                reference.path = optarg;
+                break;
+            case 't': {
+                char* end;
+                long tolerance = strtol(optarg, &end, 10);
+                if (*end || tolerance < 0 || tolerance > 255) {
+                    fprintf(stderr, "Invalid tolerance '%s'\n", optarg);
+                    return 1;
+                }
+                reference.tolerance = tolerance;
+                break;
+            }
+            case 'd':
+                reference.diff_path = optarg;
+                break;
+            case 'a':
+                all_outputs = 1;
+                break;
+            case 'h':
+                usage(argv[0]);
+                return 0;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (all_outputs && (scheduler.period_ns || reference.path)) {
+        fprintf(stderr, "--all-outputs cannot be combined with --rate or --reference\n");
+        return 1;
+    }
+    if (scheduler.count && !scheduler.period_ns) {
+        fprintf(stderr, "--count requires --rate\n");
+        return 1;
+    }
+
     struct wl_display* display = wl_display_connect(NULL);
     if (!display) {
         fprintf(stderr, "Failed to connect to Wayland display\n");
@@ -219,21 +1770,19 @@ int main() {
         fprintf(stderr, "Missing required globals\n");
         return 1;
     }
+    // Second roundtrip collects the output geometry, mode and scale events.
+    wl_display_roundtrip(display);
 
-    frame = zwlr_screencopy_manager_v1_capture_output(screencopy_manager, 1, output);
-    struct frame_data* fdata = calloc(1, sizeof(struct frame_data));
-    fprintf(stdout, "I am heren\n");
-    zwlr_screencopy_frame_v1_add_listener(frame, &frame_listener, fdata);
-    fprintf(stdout, "I am heren\n");
-    wl_display_flush(display);
-
-    while (wl_display_dispatch(display) != -1)
-        ;
-    if (!frame) {
-        fprintf(stderr, "Failed to start capture\n");
-        return 1;
-    }
+    int ret;
+    if (all_outputs)
+        ret = capture_composite(display);
+    else if (scheduler.period_ns)
+        ret = capture_scheduled(display);
+    else
+        ret = capture_once(display);
+    if (reference.pixels)
+        reference_release(&reference);
     zwlr_screencopy_manager_v1_destroy(screencopy_manager);
     wl_display_disconnect(display);
-    return 0;
+    return ret;
 }
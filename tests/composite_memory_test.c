@@ -0,0 +1,169 @@
+// Composites three outputs of mixed formats (one 8K) through the stand-in compositor and checks
+// that peak RSS stays within a few strips rather than growing with the pixel count, and that every
+// output lands at its position in the PNG.
+#define main screenshot_main
+#include "../main.c"
+#undef main
+
+#include "wayland_stub.h"
+
+// Strips of all three outputs (mapped twice, by the client and the stub) plus the encoder band
+// and zlib state come to under 16 MB; the full frames alone would be about 200 MB.
+#define RSS_CEILING_KB (48 * 1024)
+#define SCALE 2
+#define WIDTH 11520
+#define HEIGHT 6480
+
+static long status_kb(const char* key) {
+    FILE* f = fopen("/proc/self/status", "r");
+    if (!f)
+        return -1;
+    char line[256];
+    long kb = -1;
+    size_t len = strlen(key);
+    while (fgets(line, sizeof(line), f))
+        if (strncmp(line, key, len) == 0 && sscanf(line + len, ": %ld", &kb) == 1)
+            break;
+    fclose(f);
+    return kb;
+}
+
+// Resets VmHWM to the current RSS, so it measures the composite alone.
+static void reset_peak_rss(void) {
+    FILE* f = fopen("/proc/self/clear_refs", "w");
+    if (!f)
+        return;
+    fputs("5", f);
+    fclose(f);
+}
+
+// Expected 16-bit RGB at composite (x, y), following stub_pixel() and each output's format.
+static void expected_pixel(int x, int y, uint16_t* rgb) {
+    rgb[0] = rgb[1] = rgb[2] = 0;
+    if (x < 7680 && y < 4320) {
+        // Output 0, XRGB8888 at (0, 0): R = index, G = y, B = x.
+        rgb[1] = (y & 0xff) * 257;
+        rgb[2] = (x & 0xff) * 257;
+    } else if (x >= 7680 && y >= 1080 && y < 1080 + 2160) {
+        // Output 1, XBGR2101010 at (7680, 1080) buffer pixels.
+        uint32_t p = stub_pixel(1, x - 7680, y - 1080);
+        rgb[0] = expand10(p & 0x3ff);
+        rgb[1] = expand10((p >> 10) & 0x3ff);
+        rgb[2] = expand10((p >> 20) & 0x3ff);
+    } else if (x >= 1920 && x < 1920 + 3840 && y >= 4320) {
+        // Output 2, XBGR8888 at (1920, 4320): bytes B, G, R of stub_pixel() read as R, G, B.
+        rgb[0] = ((x - 1920) & 0xff) * 257;
+        rgb[1] = ((y - 4320) & 0xff) * 257;
+        rgb[2] = 2 * 257;
+    }
+}
+
+// Decodes path row by row and returns the number of pixels that differ from expected_pixel().
+static long verify_png(const char* path) {
+    FILE* f = fopen(path, "rb");
+    if (!f)
+        return -1;
+    png_structp png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    png_infop info_ptr = png_create_info_struct(png_ptr);
+    uint16_t* row = malloc((size_t)WIDTH * 3 * sizeof(uint16_t));
+    if (setjmp(png_jmpbuf(png_ptr))) {
+        png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+        free(row);
+        fclose(f);
+        return -1;
+    }
+    png_init_io(png_ptr, f);
+    png_read_info(png_ptr, info_ptr);
+    if (png_get_image_width(png_ptr, info_ptr) != WIDTH
+      || png_get_image_height(png_ptr, info_ptr) != HEIGHT
+      || png_get_bit_depth(png_ptr, info_ptr) != 16
+      || png_get_color_type(png_ptr, info_ptr) != PNG_COLOR_TYPE_RGB) {
+        fprintf(stderr, "FAIL: composite is %ux%u, depth %d, color type %d\n",
+          png_get_image_width(png_ptr, info_ptr), png_get_image_height(png_ptr, info_ptr),
+          png_get_bit_depth(png_ptr, info_ptr), png_get_color_type(png_ptr, info_ptr));
+        png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+        free(row);
+        fclose(f);
+        return -1;
+    }
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+    png_set_swap(png_ptr);
+#endif
+    long wrong = 0;
+    for (int y = 0; y < HEIGHT; y++) {
+        png_read_row(png_ptr, (png_bytep)row, NULL);
+        for (int x = 0; x < WIDTH; x++) {
+            uint16_t rgb[3];
+            expected_pixel(x, y, rgb);
+            if (memcmp(rgb, row + x * 3, sizeof(rgb)) != 0 && wrong++ == 0)
+                fprintf(stderr, "FAIL: pixel (%d, %d) is %04x %04x %04x, expected %04x %04x %04x\n",
+                  x, y, row[x * 3], row[x * 3 + 1], row[x * 3 + 2], rgb[0], rgb[1], rgb[2]);
+        }
+    }
+    png_read_end(png_ptr, NULL);
+    png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+    free(row);
+    fclose(f);
+    return wrong;
+}
+
+int main(void) {
+    char dir[] = "/tmp/composite-memory-XXXXXX";
+    if (!mkdtemp(dir) || chdir(dir) < 0) {
+        perror("FAIL: temporary directory");
+        return 1;
+    }
+
+    struct wl_display* display = wl_display_connect(NULL);
+    wl_shm = stub_create_shm();
+    screencopy_manager = stub_create_screencopy_manager();
+    // Logical positions at scale 2: an 8K output, a 4K output to its right and lower, and a 4K
+    // output below it, leaving gaps the composite must fill with zeroes.
+    struct wl_output* stub_outputs[] = {
+        stub_create_output(0, 0, 7680, 4320, SCALE),
+        stub_create_output(3840, 540, 3840, 2160, SCALE),
+        stub_create_output(960, 2160, 3840, 2160, SCALE),
+    };
+    stub_output_set_format(stub_outputs[1], WL_SHM_FORMAT_XBGR2101010, 4);
+    stub_output_set_format(stub_outputs[2], WL_SHM_FORMAT_XBGR8888, 4);
+    for (int i = 0; i < 3; i++) {
+        struct output_info* info = &outputs[output_count++];
+        info->wl_output = output = stub_outputs[i];
+        info->scale = 1;
+        wl_output_add_listener(info->wl_output, &output_listener, info);
+    }
+    wl_display_roundtrip(display);
+    // The fastest encode setting keeps the test quick; it does not change what is held in memory.
+    latency.budget_ms = 1e9;
+    latency.index = 0;
+
+    int proxies = stub_live_proxies();
+    long base_kb = status_kb("VmRSS");
+    reset_peak_rss();
+    int ret = capture_composite(display);
+    long peak_kb = status_kb("VmHWM");
+    if (ret != 0) {
+        fprintf(stderr, "FAIL: capture_composite returned %d\n", ret);
+        return 1;
+    }
+
+    if (peak_kb - base_kb > RSS_CEILING_KB) {
+        fprintf(stderr, "FAIL: peak RSS grew by %ld kB, ceiling %d kB\n", peak_kb - base_kb,
+          RSS_CEILING_KB);
+        ret = 1;
+    }
+    if (stub_live_proxies() != proxies) {
+        fprintf(stderr, "FAIL: live proxies went from %d to %d\n", proxies, stub_live_proxies());
+        ret = 1;
+    }
+    long wrong = verify_png("capture.png");
+    if (wrong != 0) {
+        fprintf(stderr, "FAIL: %ld pixels of the composite are wrong\n", wrong);
+        ret = 1;
+    }
+    remove("capture.png");
+    rmdir(dir);
+    fprintf(stderr, "%s: %dx%d composite of 3 outputs, peak RSS %ld kB over %ld kB baseline\n",
+      ret ? "FAIL" : "PASS", WIDTH, HEIGHT, peak_kb - base_kb, base_kb);
+    return ret;
+}
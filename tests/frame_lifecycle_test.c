@@ -0,0 +1,86 @@
+// Drives the frame lifecycle through the stand-in compositor with injected failed events and
+// checks that fds, proxies and RSS stay flat.
+#define main screenshot_main
+#include "../main.c"
+#undef main
+
+#include "wayland_stub.h"
+#include <dirent.h>
+
+#define WARMUP 1000
+#define CYCLES 100000
+#define RSS_SLACK_KB 1024
+
+static int count_fds(void) {
+    DIR* dir = opendir("/proc/self/fd");
+    if (!dir)
+        return -1;
+    int n = 0;
+    while (readdir(dir))
+        n++;
+    closedir(dir);
+    return n;
+}
+
+static long rss_kb(void) {
+    FILE* f = fopen("/proc/self/status", "r");
+    if (!f)
+        return -1;
+    char line[256];
+    long rss = -1;
+    while (fgets(line, sizeof(line), f))
+        if (sscanf(line, "VmRSS: %ld", &rss) == 1)
+            break;
+    fclose(f);
+    return rss;
+}
+
+int main(void) {
+    struct wl_display* display = wl_display_connect(NULL);
+    wl_shm = stub_create_shm();
+    screencopy_manager = stub_create_screencopy_manager();
+    output = stub_create_output(0, 0, 64, 64, 1);
+    // Every third frame fails before its buffer event, every fifth after the copy request.
+    stub_set_failures(3, 5);
+
+    long ready = 0, failed = 0, rss = 0;
+    int fds = 0, proxies = 0;
+    for (int i = 0; i < WARMUP + CYCLES; i++) {
+        if (i == WARMUP) {
+            fds = count_fds();
+            proxies = stub_live_proxies();
+            rss = rss_kb();
+        }
+        struct frame_data* fdata = capture_frame(display);
+        if (!fdata) {
+            fprintf(stderr, "FAIL: cycle %d did not reach a terminal state\n", i);
+            return 1;
+        }
+        if (fdata->state == FRAME_READY)
+            ready++;
+        else
+            failed++;
+        frame_data_destroy(fdata);
+    }
+
+    int ret = 0;
+    if (count_fds() != fds) {
+        fprintf(stderr, "FAIL: fd count went from %d to %d\n", fds, count_fds());
+        ret = 1;
+    }
+    if (stub_live_proxies() != proxies) {
+        fprintf(stderr, "FAIL: live proxies went from %d to %d\n", proxies, stub_live_proxies());
+        ret = 1;
+    }
+    if (rss_kb() > rss + RSS_SLACK_KB) {
+        fprintf(stderr, "FAIL: RSS grew from %ld kB to %ld kB\n", rss, rss_kb());
+        ret = 1;
+    }
+    if (!ready || !failed) {
+        fprintf(stderr, "FAIL: expected both outcomes, got %ld ready, %ld failed\n", ready, failed);
+        ret = 1;
+    }
+    fprintf(stderr, "%s: %d cycles, %ld ready, %ld failed, %d fds, RSS %ld kB\n",
+      ret ? "FAIL" : "PASS", CYCLES + WARMUP, ready, failed, count_fds(), rss_kb());
+    return ret;
+}
@@ -0,0 +1,318 @@
+#define _GNU_SOURCE
+#include "wayland_stub.h"
+#include <endian.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+const struct wl_interface wl_display_interface = { "wl_display", 1, 0, NULL, 0, NULL };
+const struct wl_interface wl_registry_interface = { "wl_registry", 1, 0, NULL, 0, NULL };
+const struct wl_interface wl_compositor_interface = { "wl_compositor", 6, 0, NULL, 0, NULL };
+const struct wl_interface wl_output_interface = { "wl_output", 4, 0, NULL, 0, NULL };
+const struct wl_interface wl_shm_interface = { "wl_shm", 1, 0, NULL, 0, NULL };
+const struct wl_interface wl_shm_pool_interface = { "wl_shm_pool", 1, 0, NULL, 0, NULL };
+const struct wl_interface wl_buffer_interface = { "wl_buffer", 1, 0, NULL, 0, NULL };
+
+enum frame_stage {
+    STAGE_NEW,
+    STAGE_WAIT_COPY,
+    STAGE_COPYING,
+    STAGE_DONE,
+};
+
+enum frame_failure {
+    FAIL_NONE,
+    FAIL_ON_CREATE,
+    FAIL_ON_COPY,
+};
+
+struct wl_proxy {
+    const struct wl_interface* interface;
+    uint32_t version;
+    void (**implementation)(void);
+    void* user_data;
+    struct wl_proxy* next;
+
+    // wl_output
+    int index, x, y, width, height, scale, bpp, announced;
+    uint32_t format;
+    // wl_shm_pool
+    int fd;
+    int32_t pool_size;
+    // wl_buffer
+    uint8_t* map;
+    size_t map_size;
+    uint8_t* data;
+    int32_t stride;
+    // zwlr_screencopy_frame_v1, region in logical and then buffer coordinates
+    struct wl_proxy* output;
+    struct wl_proxy* buffer;
+    int32_t rx, ry, rw, rh;
+    int bx, by, bw, bh;
+    enum frame_stage stage;
+    enum frame_failure fail;
+};
+
+static struct wl_proxy display_proxy = { .interface = &wl_display_interface, .version = 1 };
+static struct wl_proxy* proxies = NULL;
+static int live_proxies = 0;
+static int output_count = 0;
+static unsigned long frame_count = 0;
+static int fail_on_create = 0, fail_on_copy = 0;
+
+static struct wl_proxy* proxy_create(const struct wl_interface* interface, uint32_t version) {
+    struct wl_proxy* proxy = calloc(1, sizeof(struct wl_proxy));
+    if (!proxy) {
+        fprintf(stderr, "stub: out of memory\n");
+        abort();
+    }
+    proxy->interface = interface;
+    proxy->version = version;
+    proxy->fd = -1;
+    proxy->next = proxies;
+    proxies = proxy;
+    live_proxies++;
+    return proxy;
+}
+
+static void proxy_free(struct wl_proxy* proxy) {
+    for (struct wl_proxy** p = &proxies; *p; p = &(*p)->next) {
+        if (*p == proxy) {
+            *p = proxy->next;
+            break;
+        }
+    }
+    if (proxy->fd >= 0)
+        close(proxy->fd);
+    if (proxy->map)
+        munmap(proxy->map, proxy->map_size);
+    live_proxies--;
+    free(proxy);
+}
+
+struct wl_display* wl_display_connect(const char* name) {
+    return (struct wl_display*)&display_proxy;
+}
+
+void wl_display_disconnect(struct wl_display* display) {}
+
+int wl_display_flush(struct wl_display* display) {
+    return 0;
+}
+
+int wl_display_roundtrip(struct wl_display* display) {
+    for (struct wl_proxy* p = proxies; p; p = p->next) {
+        if (p->interface != &wl_output_interface || !p->implementation || p->announced)
+            continue;
+        const struct wl_output_listener* l = (const struct wl_output_listener*)p->implementation;
+        struct wl_output* output = (struct wl_output*)p;
+        p->announced = 1;
+        l->geometry(p->user_data, output, p->x, p->y, 0, 0, 0, "stub", "stub",
+          WL_OUTPUT_TRANSFORM_NORMAL);
+        l->mode(p->user_data, output, WL_OUTPUT_MODE_CURRENT, p->width, p->height, 60000);
+        l->scale(p->user_data, output, p->scale);
+        l->done(p->user_data, output);
+    }
+    return 0;
+}
+
+uint32_t stub_pixel(int output_index, int x, int y) {
+    return 0xff000000u | ((uint32_t)(output_index & 0xff) << 16) | ((uint32_t)(y & 0xff) << 8)
+      | (uint32_t)(x & 0xff);
+}
+
+static void frame_resolve_region(struct wl_proxy* frame) {
+    struct wl_proxy* out = frame->output;
+    if (frame->rw < 0) {
+        frame->bx = frame->by = 0;
+        frame->bw = out->width;
+        frame->bh = out->height;
+        return;
+    }
+    int lw = out->width / out->scale, lh = out->height / out->scale;
+    int x0 = frame->rx > 0 ? frame->rx : 0, y0 = frame->ry > 0 ? frame->ry : 0;
+    int x1 = frame->rx + frame->rw < lw ? frame->rx + frame->rw : lw;
+    int y1 = frame->ry + frame->rh < lh ? frame->ry + frame->rh : lh;
+    frame->bx = x0 * out->scale;
+    frame->by = y0 * out->scale;
+    frame->bw = x1 > x0 ? (x1 - x0) * out->scale : 0;
+    frame->bh = y1 > y0 ? (y1 - y0) * out->scale : 0;
+}
+
+static int frame_fill(struct wl_proxy* frame) {
+    struct wl_proxy* buffer = frame->buffer;
+    struct wl_proxy* out = frame->output;
+    if (!buffer || buffer->width != frame->bw || buffer->height != frame->bh
+      || buffer->format != out->format)
+        return -1;
+    for (int y = 0; y < frame->bh; y++) {
+        uint8_t* row = buffer->data + (size_t)y * buffer->stride;
+        if (out->bpp != 4) {
+            memset(row, 0, (size_t)frame->bw * out->bpp);
+            continue;
+        }
+        for (int x = 0; x < frame->bw; x++) {
+            uint32_t p = htole32(stub_pixel(out->index, frame->bx + x, frame->by + y));
+            memcpy(row + x * 4, &p, sizeof(p));
+        }
+    }
+    return 0;
+}
+
+int wl_display_dispatch(struct wl_display* display) {
+    for (struct wl_proxy* p = proxies; p; p = p->next) {
+        if (p->interface != &zwlr_screencopy_frame_v1_interface || !p->implementation)
+            continue;
+        const struct zwlr_screencopy_frame_v1_listener* l
+          = (const struct zwlr_screencopy_frame_v1_listener*)p->implementation;
+        struct zwlr_screencopy_frame_v1* frame = (struct zwlr_screencopy_frame_v1*)p;
+        if (p->stage == STAGE_NEW) {
+            frame_resolve_region(p);
+            if (p->fail == FAIL_ON_CREATE || !p->bw || !p->bh) {
+                p->stage = STAGE_DONE;
+                l->failed(p->user_data, frame);
+                return 1;
+            }
+            p->stage = STAGE_WAIT_COPY;
+            l->buffer(p->user_data, frame, p->output->format, p->bw, p->bh,
+              p->bw * p->output->bpp);
+            l->buffer_done(p->user_data, frame);
+            return 2;
+        }
+        if (p->stage == STAGE_COPYING) {
+            p->stage = STAGE_DONE;
+            if (p->fail == FAIL_ON_COPY || frame_fill(p) < 0) {
+                l->failed(p->user_data, frame);
+                return 1;
+            }
+            struct timespec ts;
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            uint64_t sec = ts.tv_sec;
+            l->ready(p->user_data, frame, sec >> 32, sec & 0xffffffff, ts.tv_nsec);
+            return 1;
+        }
+    }
+    return -1;
+}
+
+int wl_proxy_add_listener(struct wl_proxy* proxy, void (**implementation)(void), void* data) {
+    proxy->implementation = implementation;
+    proxy->user_data = data;
+    return 0;
+}
+
+uint32_t wl_proxy_get_version(struct wl_proxy* proxy) {
+    return proxy->version;
+}
+
+void wl_proxy_set_user_data(struct wl_proxy* proxy, void* data) {
+    proxy->user_data = data;
+}
+
+void* wl_proxy_get_user_data(struct wl_proxy* proxy) {
+    return proxy->user_data;
+}
+
+void wl_proxy_destroy(struct wl_proxy* proxy) {
+    proxy_free(proxy);
+}
+
+struct wl_proxy* wl_proxy_marshal_flags(struct wl_proxy* proxy, uint32_t opcode,
+  const struct wl_interface* interface, uint32_t version, uint32_t flags, ...) {
+    struct wl_proxy* created = NULL;
+    va_list ap;
+    va_start(ap, flags);
+    if (proxy->interface == &zwlr_screencopy_manager_v1_interface
+      && (opcode == ZWLR_SCREENCOPY_MANAGER_V1_CAPTURE_OUTPUT
+        || opcode == ZWLR_SCREENCOPY_MANAGER_V1_CAPTURE_OUTPUT_REGION)) {
+        va_arg(ap, void*);
+        va_arg(ap, int);
+        created = proxy_create(interface, version);
+        created->output = va_arg(ap, struct wl_proxy*);
+        created->rw = -1;
+        if (opcode == ZWLR_SCREENCOPY_MANAGER_V1_CAPTURE_OUTPUT_REGION) {
+            created->rx = va_arg(ap, int);
+            created->ry = va_arg(ap, int);
+            created->rw = va_arg(ap, int);
+            created->rh = va_arg(ap, int);
+        }
+        frame_count++;
+        if (fail_on_create && frame_count % fail_on_create == 0)
+            created->fail = FAIL_ON_CREATE;
+        else if (fail_on_copy && frame_count % fail_on_copy == 0)
+            created->fail = FAIL_ON_COPY;
+    } else if (proxy->interface == &zwlr_screencopy_frame_v1_interface
+      && (opcode == ZWLR_SCREENCOPY_FRAME_V1_COPY
+        || opcode == ZWLR_SCREENCOPY_FRAME_V1_COPY_WITH_DAMAGE)) {
+        proxy->buffer = va_arg(ap, struct wl_proxy*);
+        if (proxy->stage == STAGE_WAIT_COPY)
+            proxy->stage = STAGE_COPYING;
+    } else if (proxy->interface == &wl_shm_interface && opcode == 0) {
+        va_arg(ap, void*);
+        int fd = va_arg(ap, int);
+        created = proxy_create(interface, version);
+        created->fd = dup(fd);
+        created->pool_size = va_arg(ap, int);
+    } else if (proxy->interface == &wl_shm_pool_interface && opcode == 0) {
+        va_arg(ap, void*);
+        int32_t offset = va_arg(ap, int);
+        created = proxy_create(interface, version);
+        created->width = va_arg(ap, int);
+        created->height = va_arg(ap, int);
+        created->stride = va_arg(ap, int);
+        created->format = va_arg(ap, unsigned);
+        created->map_size = proxy->pool_size;
+        created->map
+          = mmap(NULL, created->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, proxy->fd, 0);
+        if (created->map == MAP_FAILED) {
+            perror("stub: mmap");
+            abort();
+        }
+        created->data = created->map + offset;
+    }
+    va_end(ap);
+    if (flags & WL_MARSHAL_FLAG_DESTROY)
+        proxy_free(proxy);
+    return created;
+}
+
+struct wl_shm* stub_create_shm(void) {
+    return (struct wl_shm*)proxy_create(&wl_shm_interface, 1);
+}
+
+struct zwlr_screencopy_manager_v1* stub_create_screencopy_manager(void) {
+    return (struct zwlr_screencopy_manager_v1*)proxy_create(
+      &zwlr_screencopy_manager_v1_interface, 3);
+}
+
+struct wl_output* stub_create_output(int32_t x, int32_t y, int width, int height, int scale) {
+    struct wl_proxy* output = proxy_create(&wl_output_interface, 4);
+    output->index = output_count++;
+    output->x = x;
+    output->y = y;
+    output->width = width;
+    output->height = height;
+    output->scale = scale;
+    output->format = WL_SHM_FORMAT_XRGB8888;
+    output->bpp = 4;
+    return (struct wl_output*)output;
+}
+
+void stub_output_set_format(struct wl_output* output, uint32_t format, int bpp) {
+    struct wl_proxy* p = (struct wl_proxy*)output;
+    p->format = format;
+    p->bpp = bpp;
+}
+
+void stub_set_failures(int on_create, int on_copy) {
+    fail_on_create = on_create;
+    fail_on_copy = on_copy;
+}
+
+int stub_live_proxies(void) {
+    return live_proxies;
+}
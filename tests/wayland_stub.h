@@ -0,0 +1,35 @@
+#ifndef WAYLAND_STUB_H
+#define WAYLAND_STUB_H
+
+#include "wlr-screencopy-unstable-v1-client-protocol.h"
+#include <stdint.h>
+#include <wayland-client.h>
+
+// Stand-in compositor for tests. It implements the libwayland-client entry points the generated
+// protocol code calls, and answers screencopy frames from wl_display_dispatch(): the buffer and
+// buffer_done events first, then ready (after filling the client's buffer) or failed once copy is
+// requested. Each dispatch delivers one frame's pending events and returns -1 when nothing is
+// pending, so a client waiting for an event that will never come fails instead of hanging.
+
+struct wl_shm* stub_create_shm(void);
+struct zwlr_screencopy_manager_v1* stub_create_screencopy_manager(void);
+
+// width and height are the output mode in buffer pixels; x and y its logical position. Geometry,
+// mode, scale and done are sent on the next roundtrip once a listener is attached.
+struct wl_output* stub_create_output(int32_t x, int32_t y, int width, int height, int scale);
+
+// Format and bytes per pixel advertised by the buffer event of later frames on this output.
+void stub_output_set_format(struct wl_output* output, uint32_t format, int bpp);
+
+// Every on_create-th frame fails before its buffer event, every on_copy-th frame fails instead
+// of becoming ready. 0 disables either.
+void stub_set_failures(int on_create, int on_copy);
+
+// Proxies created by the client or the stub that have not been destroyed.
+int stub_live_proxies(void);
+
+// Pixel written at output buffer coordinates (x, y) of 4-byte formats: B = x, G = y, R = the
+// output's index in creation order, all modulo 256, X = 0xff.
+uint32_t stub_pixel(int output_index, int x, int y);
+
+#endif